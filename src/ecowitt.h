@@ -6,6 +6,9 @@
   https://osswww.ecowitt.net/uploads/20220407/WN1900%20GW1000,1100%20WH2680,2650%20telenet%20v1.6.4.pdf
 */
 
+#ifndef ECOWITT_H
+#define ECOWITT_H
+
 /*
 Data exchange format：
 Fixed header, CMD, SIZE, DATA1, DATA2, … , DATAn, CHECKSUM
@@ -270,3 +273,4 @@ AQI derived from PM25, 24 hour running average, AQIN sensor int
 #define ITEM_Piezo_Gain10       0x87// 2*10
 #define ITEM_RST_RainTime       0x88// 3
 
+#endif
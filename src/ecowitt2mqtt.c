@@ -16,358 +16,2634 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
 #include <unistd.h>
+#include <errno.h>
 #include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <getopt.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <mosquitto.h>
 
 #include "ecowitt.h"
+#include "ecowitt_tags.h"
+#include "ecowitt_store.h"
+#include "ecowitt_cbor.h"
+#include "ecowitt_history.h"
 
 #define MQTT_QOS                     1
 #define MQTT_TIMEOUT                 10000L
 
-#define MQTT_MESSAGE_MAXLEN          32
+#define MQTT_MESSAGE_MAXLEN          132 // fits the 128 character low battery bitmask
 #define MESSAGE_EXPIRATION_SECONDS   60
 
+#define GATEWAY_TIMEOUT_SECONDS      5
+#define RECEIVE_BUFFER_SIZE          1024
+#define RAW_FRAME_SLOTS              3
+#define STORE_DEFAULT_SIZE           (4 * 1024 * 1024)
+#define MQTT_KEEPALIVE_SECONDS       10
+#define SCHEDULER_TOPIC_SLOTS        512 // at least, more when the configuration can queue more topics at once
+#define AGGREGATE_MAX_WINDOWS        4
+#define SCHEDULER_DRAIN_MS           100
+#define MQTT_MAX_BROKERS             4
+
 #define RECEIVE_BUFFER_OK            0
 #define INVALID_HEADER              -1
 #define INVALID_CHECKSUM            -2
 #define INVALID_LENGTH              -3
+#define GATEWAY_COMMAND_TTL_SECONDS  300
 
 #define TOPIC_ALL_DATA_REQUEST       "all_data/request"
+#define TOPIC_COMMANDS               "cmd/"      // cmd/<command>[/<client>], the payload holds the arguments
 #define MSG_ALL_DATA_JSON            "json"
 #define MSG_ALL_DATA_RAW             "raw"
 #define TOPIC_ALL_DATA_RAW           "all_data/raw"
 #define TOPIC_ALL_DATA_JSON          "all_data/json"
+#define TOPIC_ALL_DATA_JSON_FILTERED "all_data/json/filtered" // broadcast filtered responses, all_data/json is always the whole document
+#define TOPIC_SNAPSHOT               "state"
+#define TOPIC_DELTA                  "delta"
+#define TOPIC_DELTA_FULL             "delta/full"
+#define MSG_ALL_DATA_RESYNC          "resync"
+#define MSG_ALL_DATA_STATS           "stats"
+#define TOPIC_ALL_DATA_STATS         "all_data/stats"
+#define MSG_ALL_DATA_CBOR            "cbor"
+#define TOPIC_ALL_DATA_CBOR          "all_data/cbor"
+#define MSG_ALL_DATA_REFRESH         "refresh"
+#define MSG_ALL_DATA_HISTORY         "history"    // followed by a tag topic and a number of seconds
+#define TOPIC_ALL_DATA_HISTORY       "all_data/history"
+#define MSG_GATEWAY                  "gateway"    // followed by the name of a gateway read
+#define TOPIC_GATEWAY                "gateway/"   // gateway/<read>, the reply frame
+#define CONTENT_TYPE_CBOR            "application/cbor"
 
 char weather_host[64] = "127.0.0.1";
 int weather_port = 45000;
 int interval = 30;
+int gateway_command_ttl = GATEWAY_COMMAND_TTL_SECONDS;
 bool verbose = false;
 bool foreground = false;
-char mqtt_broker_host[128] = "localhost";
-int mqtt_broker_port       = 1883;
-char mqtt_clientid[64]     = "ecowitt2mqtt";
-char mqtt_base_topic[64]   = "ecowitt";
 
-unsigned char data_buffer[1024];
-int data_buffer_len = 0;
-time_t data_buffer_last_update = 0;
+typedef enum {
+    SNAPSHOT_OFF,
+    SNAPSHOT_ON,            // alongside the per-tag topics
+    SNAPSHOT_ONLY,          // instead of the per-tag topics
+} SNAPSHOT_MODE;
 
+SNAPSHOT_MODE snapshot_mode = SNAPSHOT_OFF;
+bool delta_enabled = false;         // changed tags only on <base_topic>/delta, see Delta
 
-#pragma mark -
+typedef enum {
+    PAYLOAD_TEXT,           // decimal text per tag, JSON snapshot
+    PAYLOAD_CBOR,           // typed CBOR values, decimal fractions for the fixed point ones
+} PAYLOAD_FORMAT;
+
+PAYLOAD_FORMAT payload_format = PAYLOAD_TEXT;
 
 typedef enum {
-    TAG_TYPE_BYTE_LEAVE_ALONE,
-    TAG_TYPE_SHORT_LEAVE_ALONE,
-    TAG_TYPE_3_BYTES_LEAVE_ALONE,
-    TAG_TYPE_INT_LEAVE_ALONE,
-    TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED,
-    TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED,
-    TAG_TYPE_3_BYTES_TEMP_AND_BATT,
-    TAG_TYPE_3_BYTES_TIME,
-    TAG_TYPE_6_BYTES_TIME,
-    TAG_TYPE_16_BYTES_BITMASK,
-    TAG_TYPE_16_BYTES_CO2,
-    TAG_TYPE_20_BYTES_PIEZO_GAIN,
-    TAG_TYPE_PM25_AQI,
-    
-} TAG_PROCESSING_TYPE;
+    PRIORITY_ALARM,         // leak and lightning: sent first, never shed
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,           // first to wait when over budget
+    PRIORITY_COUNT,
+} PRIORITY_CLASS;
 
-int tagTypeDataLength(TAG_PROCESSING_TYPE tagType) {
-    switch (tagType) {
-        case TAG_TYPE_BYTE_LEAVE_ALONE:
-            return 1;
-        case TAG_TYPE_SHORT_LEAVE_ALONE:
-        case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
-        case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
-            return 2;
-        case TAG_TYPE_3_BYTES_LEAVE_ALONE:
-        case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
-        case TAG_TYPE_3_BYTES_TIME:
-            return 3;
-        case TAG_TYPE_INT_LEAVE_ALONE:
-            return 4;
-        case TAG_TYPE_6_BYTES_TIME:
-            return 6;
-        case TAG_TYPE_16_BYTES_BITMASK:
-        case TAG_TYPE_16_BYTES_CO2:
-            return 16;
-        case TAG_TYPE_20_BYTES_PIEZO_GAIN:
-            return 20;
-        case TAG_TYPE_PM25_AQI:
-            return 0;
-        default:
-            return 0;
+const char *priority_names[PRIORITY_COUNT] = { "alarm", "normal", "low" };
+double priority_rate[PRIORITY_COUNT]  = { 0, 100, 10 };    // messages per second, 0 for no limit
+double priority_burst[PRIORITY_COUNT] = { 0, 200, 50 };    // bucket size, messages sent back to back
+
+int priority_class_named(const char *name) {
+    for (int pc = 0; pc < PRIORITY_COUNT; pc++) {
+        if (strcasecmp(name, priority_names[pc]) == 0) {
+            return pc;
+        }
+    }
+    return -1;
+}
+
+// Settings of one broker, from [mqtt] or a [mqtt.<name>] section
+typedef struct {
+    char                    name[32];           // empty for [mqtt]
+    char                    host[128];
+    int                     port;
+    char                    clientid[64];
+    char                    baseTopic[64];
+    int                     protocolVersion;
+    bool                    topicAliases;
+    int                     reconnectMin;       // seconds, the backoff doubles from here on every failed attempt
+    int                     reconnectMax;
+    int                     sessionExpiry;      // seconds the broker keeps our session after a disconnect (MQTT v5)
+    int                     maxInflight;        // messages handed to libmosquitto and not sent yet, 0 for no limit
+    double                  commandRate;        // requests per second and client, 0 for no limit
+    double                  commandBurst;
+    double                  commandTotalRate;   // requests per second over all clients, 0 for no limit
+    double                  commandTotalBurst;
+} MqttBrokerConfig;
+
+MqttBrokerConfig mqtt_broker_configs[MQTT_MAX_BROKERS] = {
+    { .name = "", .host = "localhost", .port = 1883, .clientid = "ecowitt2mqtt", .baseTopic = "ecowitt",
+      .protocolVersion = MQTT_PROTOCOL_V311, .topicAliases = true, .reconnectMin = 1, .reconnectMax = 60,
+      .sessionExpiry = 3600, .maxInflight = 20, .commandRate = 0, .commandBurst = 5,
+      .commandTotalRate = 20, .commandTotalBurst = 100 },
+};
+int mqtt_broker_count = 1;
+
+// Delivery options of a message. -1 in a tag's options means use the [publish] default
+typedef struct {
+    int                     qos;
+    int                     retain;
+    int                     expiry;             // seconds, MQTT v5 message expiry interval, 0 for none
+    const char             *contentType;        // MQTT v5 content type, NULL for none
+    bool                    sequenced;          // every message goes out in order, never replaced by a newer one nor shed
+    bool                    replay;             // a stored snapshot, its mid is kept to know when it's sent
+} PublishOptions;
+
+PublishOptions default_publish_options = { .qos = 0, .retain = false, .expiry = MESSAGE_EXPIRATION_SECONDS, .contentType = NULL };
+
+
+#pragma mark - Text builder
+
+/*
+ * Appends formatted text at the end of a fixed capacity buffer, in linear time. Output that doesn't
+ * fit is dropped and flagged, the buffer is always NUL terminated.
+ */
+typedef struct {
+    char                   *buffer;
+    size_t                  capacity;
+    size_t                  length;
+    bool                    overflow;
+} TextBuilder;
+
+TextBuilder text_builder(char *buffer, size_t capacity) {
+    TextBuilder builder = { .buffer = buffer, .capacity = capacity, .length = 0, .overflow = false };
+    if (capacity) buffer[0] = 0;
+    return builder;
+}
+
+void text_append(TextBuilder *builder, const char *format, ...) {
+    if (builder->overflow) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(builder->buffer + builder->length, builder->capacity - builder->length, format, args);
+    va_end(args);
+    if ((written < 0) || ((size_t)written >= builder->capacity - builder->length)) {
+        builder->overflow = true;
+        builder->buffer[builder->length] = 0;
+        return;
+    }
+    builder->length += written;
+}
+
+
+#pragma mark - Publish on change
+
+/*
+ * Tags configured with a deadband or a heartbeat in a [tag <pattern>] section are only published when
+ * their value moved by more than the deadband since it was last published, or when the heartbeat
+ * (maximum silence, in seconds) expired. Other tags are published with every frame.
+ * Each broker keeps its own record of what it was last sent, updated once the message is queued for it.
+ * It is cleared when the broker connects and when its queue sheds a message, so every tag goes out in
+ * full with the next frame and a broker that missed a value doesn't wait for the next change to get it.
+ */
+typedef struct {
+    bool                    onChange;
+    double                  deadband;           // absolute, in the tag's units
+    int                     heartbeat;          // seconds, 0 for no heartbeat
+    PublishOptions          options;
+    PRIORITY_CLASS          priority;
+    int                     aggregateSpans[AGGREGATE_MAX_WINDOWS]; // seconds, see Aggregates
+    int                     aggregateCount;
+} TagPublishConfig;
+
+typedef struct {
+    bool                    published;
+    bool                    numeric;
+    double                  lastValue;
+    char                    lastMessage[MQTT_MESSAGE_MAXLEN];
+    time_t                  lastPublishTimestamp;
+    atomic_ulong            publishedCount;
+    atomic_ulong            suppressedCount;
+} TagPublishState;
+
+TagPublishConfig tag_publish_config[TAG_COUNT];
+
+void tag_publish_config_init(void) {
+    for (int ti = 0; ti < TAG_COUNT; ti++) {
+        tag_publish_config[ti].options = (PublishOptions){ .qos = -1, .retain = -1, .expiry = -1 };
+        const char *topic = tagData[ti].topic;
+        bool alarm = (strncmp(topic, "leak/", 5) == 0) || (strncmp(topic, "lightning/", 10) == 0);
+        tag_publish_config[ti].priority = alarm ? PRIORITY_ALARM : PRIORITY_NORMAL;
+    }
+}
+
+PublishOptions tag_publish_options(int ti) {
+    PublishOptions options = tag_publish_config[ti].options;
+    if (options.qos < 0) options.qos = default_publish_options.qos;
+    if (options.retain < 0) options.retain = default_publish_options.retain;
+    if (options.expiry < 0) options.expiry = default_publish_options.expiry;
+    return options;
+}
+
+// Patterns are a topic, a topic prefix ending with *, or * for every tag
+bool topic_matches(const char *pattern, const char *topic) {
+    size_t length = strlen(pattern);
+    if ((length > 0) && (pattern[length - 1] == '*')) {
+        return strncmp(pattern, topic, length - 1) == 0;
+    }
+    return strcmp(pattern, topic) == 0;
+}
+
+// Decides whether a tag is published to a broker this frame, given the state of that broker
+bool tag_should_publish(TagPublishState *state, int ti, const char *message, const TagValue *value, time_t now) {
+    TagPublishConfig *config = &tag_publish_config[ti];
+    bool publish = true;
+    if (config->onChange && state->published) {
+        publish = false;
+        if ((config->heartbeat > 0) && ((now - state->lastPublishTimestamp) >= config->heartbeat)) {
+            publish = true;
+        }
+        else if (value && state->numeric) {
+            publish = fabs(tag_value_as_double(value) - state->lastValue) > config->deadband;
+        }
+        else {
+            publish = strcmp(message, state->lastMessage) != 0;
+        }
     }
+    if (!publish) {
+        atomic_fetch_add_explicit(&state->suppressedCount, 1, memory_order_relaxed);
+    }
+    return publish;
+}
+
+// Records a tag value as sent to the broker the state belongs to, once it's queued
+void tag_publish_record(TagPublishState *state, const char *message, const TagValue *value, time_t now) {
+    state->published = true;
+    state->numeric = (value != NULL);
+    if (value) {
+        state->lastValue = tag_value_as_double(value);
+    }
+    strcpy(state->lastMessage, message);
+    state->lastPublishTimestamp = now;
+    atomic_fetch_add_explicit(&state->publishedCount, 1, memory_order_relaxed);
 }
 
+
+
+#pragma mark - Tag state
+
+/*
+ * The last value of every tag, as of the last verified frame. The poll thread is the only writer and
+ * wraps each frame commit in a sequence lock; readers copy the whole snapshot and retry if the sequence
+ * was odd or moved while they copied, so they always get one consistent frame and never hold up the poll.
+ */
 typedef struct {
-    unsigned char           tag;
-    TAG_PROCESSING_TYPE     type;
-    char*                   topic;
     char                    lastMessage[MQTT_MESSAGE_MAXLEN];
     time_t                  lastMessageTimestamp;
-} TagSpec;
-
-TagSpec tagData[] = {
-    { .tag = ITEM_INTEMP                , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/indoors"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_OUTTEMP               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/outdoors"   , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_DEWPOINT              , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "dew_point"              , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_WINDCHILL             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "wind_chill"             , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HEATINDEX             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "heat_index"             , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_INHUMI                , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/indoors"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_OUTHUMI               , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/outdoors"      , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_ABSBARO               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED  , .topic = "barometric/absolute"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RELBARO               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED  , .topic = "barometric/relative"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_WINDDIRECTION         , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/direction"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_WINDSPEED             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/speed"             , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_GUSTSPEED             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/gust_speed"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINEVENT             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/event"             , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINRATE              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/rate"              , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINHOUR              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/hour"              , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINDAY               , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/day"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINWEEK              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/week"              , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINMONTH             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/month"             , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINYEAR              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/year"              , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RAINTOTALS            , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/totals"            , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LIGHT                 , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "light"                  , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_UV                    , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "uv/intensity"           , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_UVI                   , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "uv/index"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TIME                  , .type = TAG_TYPE_6_BYTES_TIME                 , .topic = "date_and_time"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_DAYLWINDMAX           , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/day_max"           , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP1                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_1"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP2                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_2"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP3                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_3"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP4                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_4"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP5                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_5"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP6                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_6"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP7                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_7"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TEMP8                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_8"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI1                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_1"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI2                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_2"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI3                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_3"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI4                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_4"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI5                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_5"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI6                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_6"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI7                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_7"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_HUMI8                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_8"          , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_CH1              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "air_quality"            , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP1             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_1"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE1         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_1"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP2             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_2"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE2         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_2"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP3             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_3"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE3         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_3"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP4             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_4"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE4         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_4"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP5             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_5"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE5         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_5"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP6             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_6"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE6         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_6"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP7             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_7"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE7         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_7"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP8             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_8"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE8         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_8"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP9             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_9"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE9         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_9"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP10            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_10"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE10        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_10"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP11            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_11"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE11        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_11"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP12            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_12"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE12        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_12"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP13            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_13"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE13        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_13"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP14            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_14"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE14        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_14"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP15            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_15"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE15        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_15"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILTEMP16            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_16"    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SOILMOISTURE16        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_16"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LOWBATT               , .type = TAG_TYPE_16_BYTES_BITMASK             , .topic = "all_sensor_low_battery" , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_24HAVG1          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch1"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_24HAVG2          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch2"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_24HAVG3          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch3"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_24HAVG4          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch4"               , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_CH2              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/2"                  , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_CH3              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/3"                  , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_CH4              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/4"                  , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAK_CH1              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/1"                 , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAK_CH2              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/2"                 , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAK_CH3              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/3"                 , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAK_CH4              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/4"                 , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LIGHTNING             , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "lightning/distance"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LIGHTNING_TIME        , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "lightning/time"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LIGHTNING_POWER       , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "lightning/day_counter"  , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR1               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t1"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR2               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t2"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR3               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t3"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR4               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t4"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR5               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t5"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR6               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t6"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR7               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t7"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_TF_USR8               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t8"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_SENSOR_CO2            , .type = TAG_TYPE_16_BYTES_CO2                 , .topic = "co2"                    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_PM25_AQI              , .type = TAG_TYPE_PM25_AQI                     , .topic = "aqi"                    , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH1      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/1"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH2      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/2"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH3      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/3"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH4      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/4"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH5      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/5"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH6      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/6"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH7      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/7"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_LEAF_WETNESS_CH8      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/8"         , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Rain_Rate       , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/rate"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Event_Rain      , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/event"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Hourly_Rain     , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/hourly"      , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Daily_Rain      , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/daily"       , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Weekly_Rain     , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/weekly"      , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Monthly_Rain    , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/monthly"     , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_yearly_Rain     , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/yearly"      , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_Piezo_Gain10          , .type = TAG_TYPE_20_BYTES_PIEZO_GAIN          , .topic = "rain/piezo/gain"        , .lastMessageTimestamp = 0 },
-    { .tag = ITEM_RST_RainTime          , .type = TAG_TYPE_3_BYTES_TIME                 , .topic = "rain/rst/time"          , .lastMessageTimestamp = 0 },
-};
+    unsigned long           lastGeneration;     // frame it was last read in
+    bool                    numeric;
+    TagValue                value;
+} TagState;
 
-#pragma mark -
+typedef struct {
+    unsigned long           generation;
+    time_t                  timestamp;
+    TagState                tags[TAG_COUNT];
+} FrameSnapshot;
+
+FrameSnapshot tag_state;
+atomic_uint tag_state_sequence = 0;
+unsigned long frame_generation = 0;
+
+void tag_state_write_begin(void) {
+    atomic_fetch_add_explicit(&tag_state_sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void tag_state_write_end(void) {
+    atomic_fetch_add_explicit(&tag_state_sequence, 1, memory_order_release);
+}
+
+// Copies the current frame, returns the sequence it was copied at
+unsigned int tag_state_snapshot(FrameSnapshot *snapshot) {
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&tag_state_sequence, memory_order_acquire);
+        if (before & 1) {
+            continue; // commit in progress
+        }
+        memcpy(snapshot, &tag_state, sizeof(*snapshot));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&tag_state_sequence, memory_order_relaxed);
+    } while ((before & 1) || (before != after));
+    return before;
+}
+
+// Same as tag_state_snapshot for only the given tags, the others are left as they are
+void tag_state_read(FrameSnapshot *snapshot, const int *tags, int count) {
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&tag_state_sequence, memory_order_acquire);
+        if (before & 1) {
+            continue; // commit in progress
+        }
+        snapshot->generation = tag_state.generation;
+        snapshot->timestamp = tag_state.timestamp;
+        for (int i = 0; i < count; i++) {
+            snapshot->tags[tags[i]] = tag_state.tags[tags[i]];
+        }
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&tag_state_sequence, memory_order_relaxed);
+    } while ((before & 1) || (before != after));
+}
 
-int tag_count() {
-    return sizeof(tagData) / sizeof(tagData[0]);
+
+#pragma mark - Raw frame slots
+
+/*
+ * Gateway replies are received straight into one of a few slots. Once a reply is verified the slot is
+ * published by swapping raw_frame_current, RCU style: readers on the mosquitto thread pin the current slot
+ * with a reader count and publish from it in place, while the poll thread only ever receives into a slot
+ * that is neither current nor pinned. Readers never see a torn frame and neither side waits on the other.
+ */
+typedef struct {
+    unsigned char           data[RECEIVE_BUFFER_SIZE];
+    size_t                  length;
+    unsigned long           generation;
+    time_t                  timestamp;
+    atomic_int              readers;
+} RawFrameSlot;
+
+RawFrameSlot raw_frame_slots[RAW_FRAME_SLOTS];
+RawFrameSlot raw_frame_scratch; // only used when every slot is current or pinned, never published
+_Atomic(RawFrameSlot *) raw_frame_current = NULL;
+
+// Poll thread: a slot that is safe to receive the next reply into
+RawFrameSlot *raw_frame_write_slot(void) {
+    RawFrameSlot *current = atomic_load(&raw_frame_current);
+    for (int i = 0; i < RAW_FRAME_SLOTS; i++) {
+        RawFrameSlot *slot = &raw_frame_slots[i];
+        if ((slot != current) && (atomic_load(&slot->readers) == 0)) {
+            return slot;
+        }
+    }
+    return &raw_frame_scratch;
+}
+
+// Poll thread: makes a verified reply the one readers get
+void raw_frame_publish(RawFrameSlot *slot, size_t length, unsigned long generation) {
+    if (slot == &raw_frame_scratch) {
+        return;
+    }
+    slot->length = length;
+    slot->generation = generation;
+    time(&slot->timestamp);
+    atomic_store(&raw_frame_current, slot);
 }
 
-int tag_index(int tag) {
-    for (int i = tag_count() -1; i >= 0; i--) {
-        if (tag == tagData[i].tag) {
-            return i;
+// Readers: pins the current slot until raw_frame_release(), NULL if nothing was received yet
+RawFrameSlot *raw_frame_acquire(void) {
+    while (1) {
+        RawFrameSlot *slot = atomic_load(&raw_frame_current);
+        if (slot == NULL) {
+            return NULL;
         }
+        atomic_fetch_add(&slot->readers, 1);
+        if (atomic_load(&raw_frame_current) == slot) {
+            return slot;
+        }
+        // swapped out before the pin took effect, the poll thread may already be receiving into it
+        atomic_fetch_sub(&slot->readers, 1);
     }
-    return -1;
+}
+
+void raw_frame_release(RawFrameSlot *slot) {
+    atomic_fetch_sub(&slot->readers, 1);
 }
 
 
+#pragma mark - Store and forward
+
+char store_path[256]   = "";        // empty: no store, frames are lost while the broker is down
+size_t store_size      = STORE_DEFAULT_SIZE;
+int store_replay_rate  = 5;         // stored snapshots replayed per second once the broker is back
+
+
+#pragma mark - History
+
+#define HISTORY_MAX_POINTS           20000 // per response, the newest ones
+
+int history_retention = 0;          // seconds of history kept per numeric tag, 0 for none
+HistorySeries history_series[TAG_COUNT];
+pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+#pragma mark - HTTP endpoint
+
+char http_address[64]  = "127.0.0.1";
+int http_port          = 0;         // 0: no HTTP endpoint
 
 
 #pragma mark -
+bool config_bool(const char *value) {
+    return (strcasecmp(value, "true") == 0) || (strcasecmp(value, "yes") == 0) || (strcasecmp(value, "on") == 0) || (strcmp(value, "1") == 0);
+}
+
+void config_tag_setting(const char *pattern, const char *key, const char *value) {
+    for (int ti = 0; ti < tag_count(); ti++) {
+        if (!topic_matches(pattern, tagData[ti].topic)) {
+            continue;
+        }
+        if (strcmp(key, "deadband") == 0) {
+            tag_publish_config[ti].onChange = true;
+            tag_publish_config[ti].deadband = atof(value);
+        }
+        else if (strcmp(key, "heartbeat") == 0) {
+            tag_publish_config[ti].onChange = true;
+            tag_publish_config[ti].heartbeat = atoi(value);
+        }
+        else if (strcmp(key, "qos") == 0) tag_publish_config[ti].options.qos = atoi(value);
+        else if (strcmp(key, "retain") == 0) tag_publish_config[ti].options.retain = config_bool(value);
+        else if (strcmp(key, "expiry") == 0) tag_publish_config[ti].options.expiry = atoi(value);
+        else if ((strcmp(key, "priority") == 0) && (priority_class_named(value) >= 0)) tag_publish_config[ti].priority = priority_class_named(value);
+        else if (strcmp(key, "aggregate") == 0) {
+            // comma separated window lengths in seconds
+            TagPublishConfig *config = &tag_publish_config[ti];
+            config->aggregateCount = 0;
+            const char *span = value;
+            while (*span && (config->aggregateCount < AGGREGATE_MAX_WINDOWS)) {
+                if (atoi(span) > 0) {
+                    config->aggregateSpans[config->aggregateCount++] = atoi(span);
+                }
+                span += strcspn(span, ",");
+                span += (*span == ',');
+            }
+        }
+    }
+}
+
+void config_broker_setting(MqttBrokerConfig *config, const char *key, const char *value) {
+    if (strcmp(key, "broker_host") == 0) snprintf(config->host, sizeof(config->host), "%s", value);
+    else if (strcmp(key, "broker_port") == 0) config->port = atoi(value);
+    else if (strcmp(key, "clientid") == 0) snprintf(config->clientid, sizeof(config->clientid), "%s", value);
+    else if (strcmp(key, "base_topic") == 0) snprintf(config->baseTopic, sizeof(config->baseTopic), "%s", value);
+    else if (strcmp(key, "protocol") == 0) config->protocolVersion = (strcmp(value, "5") == 0) ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311;
+    else if (strcmp(key, "topic_aliases") == 0) config->topicAliases = config_bool(value);
+    else if (strcmp(key, "reconnect_min") == 0) config->reconnectMin = atoi(value);
+    else if (strcmp(key, "reconnect_max") == 0) config->reconnectMax = atoi(value);
+    else if (strcmp(key, "session_expiry") == 0) config->sessionExpiry = atoi(value);
+    else if (strcmp(key, "max_inflight") == 0) config->maxInflight = atoi(value);
+    else if (strcmp(key, "command_rate") == 0) config->commandRate = atof(value);
+    else if (strcmp(key, "command_burst") == 0) config->commandBurst = atof(value);
+    else if (strcmp(key, "command_total_rate") == 0) config->commandTotalRate = atof(value);
+    else if (strcmp(key, "command_total_burst") == 0) config->commandTotalBurst = atof(value);
+}
+
+// A [mqtt.<name>] broker, created on first use from the [mqtt] settings read so far
+MqttBrokerConfig *config_broker_named(const char *name) {
+    for (int bi = 1; bi < mqtt_broker_count; bi++) {
+        if (strcmp(mqtt_broker_configs[bi].name, name) == 0) {
+            return &mqtt_broker_configs[bi];
+        }
+    }
+    if (mqtt_broker_count == MQTT_MAX_BROKERS) {
+        fprintf(stderr, "Too many brokers, [mqtt.%s] ignored\n", name);
+        return NULL;
+    }
+    MqttBrokerConfig *config = &mqtt_broker_configs[mqtt_broker_count++];
+    *config = mqtt_broker_configs[0];
+    snprintf(config->name, sizeof(config->name), "%s", name);
+    return config;
+}
+
+void config_setting(const char *section, const char *key, const char *value) {
+    if (strcmp(section, "weather_station") == 0) {
+        if (strcmp(key, "host") == 0) snprintf(weather_host, sizeof(weather_host), "%s", value);
+        else if (strcmp(key, "port") == 0) weather_port = atoi(value);
+        else if (strcmp(key, "interval") == 0) interval = atoi(value);
+        else if (strcmp(key, "command_ttl") == 0) gateway_command_ttl = atoi(value);
+    }
+    else if (strcmp(section, "mqtt") == 0) {
+        config_broker_setting(&mqtt_broker_configs[0], key, value);
+    }
+    else if (strncmp(section, "mqtt.", 5) == 0) {
+        MqttBrokerConfig *config = config_broker_named(section + 5);
+        if (config) {
+            config_broker_setting(config, key, value);
+        }
+    }
+    else if (strcmp(section, "publish") == 0) {
+        if (strcmp(key, "snapshot") == 0) {
+            if (strcasecmp(value, "only") == 0) snapshot_mode = SNAPSHOT_ONLY;
+            else snapshot_mode = config_bool(value) ? SNAPSHOT_ON : SNAPSHOT_OFF;
+        }
+        else if (strcmp(key, "delta") == 0) delta_enabled = config_bool(value);
+        else if (strcmp(key, "qos") == 0) default_publish_options.qos = atoi(value);
+        else if (strcmp(key, "retain") == 0) default_publish_options.retain = config_bool(value);
+        else if (strcmp(key, "expiry") == 0) default_publish_options.expiry = atoi(value);
+        else if (strcmp(key, "format") == 0) payload_format = (strcasecmp(value, "cbor") == 0) ? PAYLOAD_CBOR : PAYLOAD_TEXT;
+        else if ((strncmp(key, "rate_", 5) == 0) && (priority_class_named(key + 5) >= 0)) priority_rate[priority_class_named(key + 5)] = atof(value);
+        else if ((strncmp(key, "burst_", 6) == 0) && (priority_class_named(key + 6) >= 0)) priority_burst[priority_class_named(key + 6)] = atof(value);
+    }
+    else if (strcmp(section, "store") == 0) {
+        if (strcmp(key, "path") == 0) snprintf(store_path, sizeof(store_path), "%s", value);
+        else if (strcmp(key, "size") == 0) store_size = strtoul(value, NULL, 10);
+        else if (strcmp(key, "replay_rate") == 0) store_replay_rate = atoi(value);
+    }
+    else if (strcmp(section, "history") == 0) {
+        if (strcmp(key, "retention") == 0) history_retention = atoi(value);
+    }
+    else if (strcmp(section, "http") == 0) {
+        if (strcmp(key, "port") == 0) http_port = atoi(value);
+        else if (strcmp(key, "address") == 0) snprintf(http_address, sizeof(http_address), "%s", value);
+    }
+    else if (strncmp(section, "tag ", 4) == 0) {
+        config_tag_setting(section + 4, key, value);
+    }
+}
+
+// ini style: [section] headers followed by key = value lines, # and ; start comments
 void load_config(const char *filename) {
     FILE *f = fopen(filename, "r");
     if (!f) return;
     char line[256];
+    char section[128] = "";
+    char key[64];
+    char value[192];
     while (fgets(line, sizeof(line), f)) {
-        if (strstr(line, "host")) sscanf(line, "host = %63s", weather_host);
-        if (strstr(line, "port")) sscanf(line, "port = %d", &weather_port);
-        if (strstr(line, "interval")) sscanf(line, "interval = %d", &interval);
-        if (strstr(line, "broker_host")) sscanf(line, "broker = %127s", mqtt_broker_host);
-        if (strstr(line, "broker_port")) sscanf(line, "broker = %d", &mqtt_broker_port);
-        if (strstr(line, "clientid")) sscanf(line, "clientid = %63s", mqtt_clientid);
-        if (strstr(line, "base_topic")) sscanf(line, "base_topic = %63s", mqtt_base_topic);
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if ((*p == 0) || (*p == '#') || (*p == ';')) {
+            continue;
+        }
+        if (*p == '[') {
+            if (sscanf(p, "[%127[^]]]", section) != 1) section[0] = 0;
+            continue;
+        }
+        if (sscanf(p, "%63[^= \t] = %191[^\r\n]", key, value) == 2) {
+            for (char *end = value + strlen(value) - 1; (end >= value) && isspace((unsigned char)*end); end--) {
+                *end = 0;
+            }
+            config_setting(section, key, value);
+        }
     }
     fclose(f);
 }
 
 #pragma mark -
 
-void mqtt_publish_data(struct mosquitto *mosq, const char *topic_suffix, const void *payload, int payload_len) {
-    char full_topic[128];
-    snprintf(full_topic, sizeof(full_topic), "%s/%s", mqtt_base_topic, topic_suffix);
-    if (foreground && verbose) {
-        printf("Publishing on topic %s\n", full_topic);
+#pragma mark - Topic aliases
+
+/*
+ * MQTT v5 topic aliases: the first publish on a topic carries the full topic and assigns it the next
+ * alias, later publishes only send the 2 byte alias. Aliases only live as long as the connection, the
+ * table is cleared on every CONNACK and never grows past the broker's advertised maximum. Only used for
+ * qos 0 messages, which libmosquitto never carries over to the next connection. The table stays locked
+ * from the lookup until the publish is queued, so a packet carrying only the alias can't overtake the one
+ * that assigns it; an assignment whose publish failed is taken back.
+ */
+#define TOPIC_ALIAS_SLOTS            256
+
+typedef struct {
+    char                    topic[128];
+    int                     alias;
+} TopicAlias;
+
+typedef struct {
+    TopicAlias              entries[TOPIC_ALIAS_SLOTS];
+    int                     maximum;
+    int                     count;
+    pthread_mutex_t         lock;
+} TopicAliasTable;
+
+unsigned int topic_hash(const char *topic) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    while (*topic) {
+        hash = (hash ^ (unsigned char)*topic++) * 16777619u;
     }
-    int rc = mosquitto_publish(mosq, NULL, full_topic, payload_len, payload, 0, false);
-    if (rc != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "Error publishing message: %s\n", mosquitto_strerror(rc));
+    return hash;
+}
+
+void topic_aliases_reset(TopicAliasTable *table, int maximum) {
+    pthread_mutex_lock(&table->lock);
+    memset(table->entries, 0, sizeof(table->entries));
+    table->count = 0;
+    table->maximum = (maximum < TOPIC_ALIAS_SLOTS / 2) ? maximum : TOPIC_ALIAS_SLOTS / 2; // keep the table sparse
+    pthread_mutex_unlock(&table->lock);
+}
+
+// Alias for topic, 0 if there is none to use; *assigned is set when the alias is new and the topic must be sent with it.
+// Called with the table locked
+int topic_alias_lookup(TopicAliasTable *table, const char *topic, bool *assigned) {
+    *assigned = false;
+    if (strlen(topic) >= sizeof(table->entries[0].topic)) {
+        return 0;
+    }
+    int alias = 0;
+    for (unsigned int slot = topic_hash(topic) % TOPIC_ALIAS_SLOTS, probes = 0; probes < TOPIC_ALIAS_SLOTS; slot = (slot + 1) % TOPIC_ALIAS_SLOTS, probes++) {
+        TopicAlias *entry = &table->entries[slot];
+        if (entry->alias == 0) {
+            if (table->count < table->maximum) {
+                strcpy(entry->topic, topic);
+                entry->alias = ++table->count;
+                alias = entry->alias;
+                *assigned = true;
+            }
+            break;
+        }
+        if (strcmp(entry->topic, topic) == 0) {
+            alias = entry->alias;
+            break;
+        }
+    }
+    return alias;
+}
+
+// Takes back the alias just assigned to topic, its publish didn't go out. Called with the table locked, before
+// any other assignment: the entry is the last one added, so clearing it leaves no hole in a probe chain
+void topic_alias_forget(TopicAliasTable *table, const char *topic) {
+    for (unsigned int slot = topic_hash(topic) % TOPIC_ALIAS_SLOTS, probes = 0; probes < TOPIC_ALIAS_SLOTS; slot = (slot + 1) % TOPIC_ALIAS_SLOTS, probes++) {
+        TopicAlias *entry = &table->entries[slot];
+        if (entry->alias == 0) {
+            break;
+        }
+        if (strcmp(entry->topic, topic) == 0) {
+            memset(entry, 0, sizeof(*entry));
+            table->count--;
+            break;
+        }
     }
 }
 
-void mqtt_publish(struct mosquitto *mosq, const char *topic_suffix, const char *payload) {
-    mqtt_publish_data(mosq, topic_suffix, payload, strlen(payload));
+size_t mqtt_varint_size(size_t value) {
+    size_t size = 1;
+    while (value >= 128) {
+        value /= 128;
+        size++;
+    }
+    return size;
 }
 
-void mqtt_subscribe(struct mosquitto *mosq, const char *topic_suffix) {
-    char full_topic[128];
-    snprintf(full_topic, sizeof(full_topic), "%s/%s", mqtt_base_topic, topic_suffix);
-    if (foreground && verbose) {
-        printf("Subscribing to topic %s\n", full_topic);
+// Size on the wire of a PUBLISH packet
+size_t mqtt_publish_packet_size(size_t topic_length, size_t payload_length, size_t properties_length, int qos, bool v5) {
+    size_t remaining = 2 + topic_length + (qos ? 2 : 0) + payload_length;
+    if (v5) {
+        remaining += mqtt_varint_size(properties_length) + properties_length;
     }
-    int rc = mosquitto_subscribe(mosq, NULL, full_topic, 0);
-    if (rc != MOSQ_ERR_SUCCESS) {
-        fprintf(stderr, "Error subscribing to topic %s: %s\n", full_topic, mosquitto_strerror(rc));
+    return 1 + mqtt_varint_size(remaining) + remaining;
+}
+
+
+#pragma mark - Publish scheduler
+
+/*
+ * Frame messages are queued by priority class and sent in class order, each class limited by its own
+ * token bucket (rate messages per second, up to burst at once). Alarms go out ahead of everything
+ * queued and aren't limited by default. Over budget, normal and low messages wait for tokens and are
+ * shed when they outlive their expiry while waiting.
+ * The queue keeps one pending slot per topic: a newer message for a topic that is still waiting
+ * replaces it in place, keeping its turn, so the queue never holds more than one message per topic
+ * and only current values go out once the link catches up. Alarms and sequenced messages (deltas,
+ * replayed snapshots) are the exception: each of them is queued, and sent however long it waits.
+ * Slots are released once their message is sent or shed, so only waiting messages hold one. An alarm
+ * that finds the table full sheds the oldest replaceable message of the lowest class to take its slot.
+ * Messages are only handed to libmosquitto while fewer than max_inflight of its own are still unsent,
+ * which keeps its queue short too.
+ * The poll thread drains right after queueing a frame, the broker thread whenever tokens come back.
+ */
+typedef struct {
+    char                    topic[128];         // suffix under the base topic, empty for a free slot
+    void                   *payload;            // kept between messages, only grows
+    int                     length;
+    int                     capacity;
+    PublishOptions          options;
+    time_t                  queuedAt;
+    PRIORITY_CLASS          priority;
+    bool                    pending;
+    bool                    coalesce;           // replaced by the next message on its topic while waiting
+    bool                    released;           // free again, but lookups have to probe past it
+    int                     next;               // next pending slot of the class, -1 at the tail
+} PendingPublish;
+
+typedef struct {
+    int                     head;               // pending slots in queueing order, -1 when empty
+    int                     tail;
+    int                     count;
+    double                  rate;
+    double                  burst;
+    double                  tokens;
+    double                  refilledAt;
+    unsigned long           sent;
+    unsigned long           deferred;           // drains that left messages waiting for tokens
+    unsigned long           coalesced;          // messages replaced by a newer one before they were sent
+    unsigned long           shed;
+} PriorityQueue;
+
+typedef struct {
+    pthread_mutex_t         lock;
+    PendingPublish         *slots;
+    int                     slotCount;
+    int                     pendingCount;
+    PriorityQueue           classes[PRIORITY_COUNT];
+    atomic_bool             shed;               // a message was shed since the poll thread last looked
+} PublishScheduler;
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Twice the messages a single frame can queue (tags, batteries, aggregates and the frame wide topics),
+// so the table stays sparse even when a whole frame waits
+int publish_scheduler_capacity(void) {
+    int topics = 16;
+    for (int ti = 0; ti < tag_count(); ti++) {
+        topics += 2 + tag_publish_config[ti].aggregateCount;
     }
+    return (2 * topics > SCHEDULER_TOPIC_SLOTS) ? 2 * topics : SCHEDULER_TOPIC_SLOTS;
 }
 
-void publish_raw(struct mosquitto *mosq) {
-    time_t now;
-    time(&now);
-    if ((now - data_buffer_last_update) > MESSAGE_EXPIRATION_SECONDS) {
-        fprintf(stderr, "Can't publish data, it's stale. Haven't received an update in %ld seconds\n", now - data_buffer_last_update);
+bool publish_scheduler_init(PublishScheduler *scheduler) {
+    pthread_mutex_init(&scheduler->lock, NULL);
+    scheduler->slotCount = publish_scheduler_capacity();
+    scheduler->slots = calloc(scheduler->slotCount, sizeof(PendingPublish));
+    if (scheduler->slots == NULL) {
+        fprintf(stderr, "Could not allocate %d publish slots\n", scheduler->slotCount);
+        return false;
+    }
+    for (int pc = 0; pc < PRIORITY_COUNT; pc++) {
+        PriorityQueue *queue = &scheduler->classes[pc];
+        queue->head = queue->tail = -1;
+        queue->rate = priority_rate[pc];
+        queue->burst = (priority_burst[pc] >= 1) ? priority_burst[pc] : 1;
+        queue->tokens = queue->burst;
+        queue->refilledAt = monotonic_seconds();
+    }
+    return true;
+}
+
+// The slot for a message on a topic: with coalesce, the one still waiting on that topic if there is one,
+// else a free slot. Open addressing on the topic hash
+PendingPublish *publish_scheduler_slot(PublishScheduler *scheduler, const char *topic_suffix, bool coalesce) {
+    unsigned int index = topic_hash(topic_suffix) % scheduler->slotCount;
+    PendingPublish *free_slot = NULL;
+    for (int probe = 0; probe < scheduler->slotCount; probe++, index = (index + 1) % scheduler->slotCount) {
+        PendingPublish *slot = &scheduler->slots[index];
+        if (slot->topic[0] == 0) {
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+            if (!coalesce || !slot->released) {
+                break; // end of the probe chain, or any free slot will do
+            }
+        }
+        else if (coalesce && slot->coalesce && (strcmp(slot->topic, topic_suffix) == 0)) {
+            return slot;
+        }
+    }
+    if (free_slot) {
+        snprintf(free_slot->topic, sizeof(free_slot->topic), "%s", topic_suffix);
+        free_slot->coalesce = coalesce;
+        free_slot->released = false;
+        free_slot->next = -1;
+    }
+    return free_slot;
+}
+
+// Takes the slot after prev out of the queue, the head when prev is -1
+int priority_queue_remove(PublishScheduler *scheduler, PriorityQueue *queue, int prev) {
+    int index = (prev < 0) ? queue->head : scheduler->slots[prev].next;
+    PendingPublish *slot = &scheduler->slots[index];
+    if (prev < 0) {
+        queue->head = slot->next;
+    }
+    else {
+        scheduler->slots[prev].next = slot->next;
+    }
+    if (queue->tail == index) {
+        queue->tail = prev;
+    }
+    queue->count--;
+    slot->pending = false;
+    slot->next = -1;
+    slot->topic[0] = 0;
+    slot->released = true;
+    if (--scheduler->pendingCount == 0) {
+        // nothing waits, no probe chain left to keep
+        for (int si = 0; si < scheduler->slotCount; si++) {
+            scheduler->slots[si].released = false;
+        }
+    }
+    return index;
+}
+
+int priority_queue_pop(PublishScheduler *scheduler, PriorityQueue *queue) {
+    return priority_queue_remove(scheduler, queue, -1);
+}
+
+// Makes room for an alarm in a full table by shedding the oldest message a newer reading would replace
+// anyway, from the lowest class that has one. False when only alarms and sequenced messages wait
+bool publish_scheduler_evict(PublishScheduler *scheduler) {
+    for (int pc = PRIORITY_COUNT - 1; pc > PRIORITY_ALARM; pc--) {
+        PriorityQueue *queue = &scheduler->classes[pc];
+        for (int prev = -1, index = queue->head; index >= 0; prev = index, index = scheduler->slots[index].next) {
+            if (scheduler->slots[index].coalesce) {
+                priority_queue_remove(scheduler, queue, prev);
+                queue->shed++;
+                atomic_store(&scheduler->shed, true);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Takes a token from the class bucket, false when it's empty
+bool priority_queue_take_token(PriorityQueue *queue, double now) {
+    if (queue->rate <= 0) {
+        return true;
+    }
+    queue->tokens += (now - queue->refilledAt) * queue->rate;
+    queue->refilledAt = now;
+    if (queue->tokens > queue->burst) {
+        queue->tokens = queue->burst;
+    }
+    if (queue->tokens < 1) {
+        return false;
+    }
+    queue->tokens -= 1;
+    return true;
+}
+
+bool publish_scheduler_enqueue(PublishScheduler *scheduler, PRIORITY_CLASS priority, const char *topic_suffix,
+                               const void *payload, int length, const PublishOptions *options) {
+    pthread_mutex_lock(&scheduler->lock);
+    bool coalesce = (priority != PRIORITY_ALARM) && !options->sequenced;
+    PendingPublish *slot = publish_scheduler_slot(scheduler, topic_suffix, coalesce);
+    if ((slot == NULL) && (priority == PRIORITY_ALARM) && publish_scheduler_evict(scheduler)) {
+        slot = publish_scheduler_slot(scheduler, topic_suffix, coalesce);
+    }
+    if ((slot != NULL) && (slot->capacity < length)) {
+        void *grown = realloc(slot->payload, length);
+        if (grown) {
+            slot->payload = grown;
+            slot->capacity = length;
+        }
+    }
+    if ((slot == NULL) || (slot->capacity < length)) {
+        pthread_mutex_unlock(&scheduler->lock);
+        fprintf(stderr, "Could not queue a message for %s\n", topic_suffix);
+        return false;
+    }
+    if (length) {
+        memcpy(slot->payload, payload, length);
+    }
+    slot->length = length;
+    slot->options = *options;
+    slot->queuedAt = time(NULL);
+    if (slot->pending) {
+        // still waiting: the new value takes its place in the queue
+        scheduler->classes[slot->priority].coalesced++;
     }
     else {
-        if (data_buffer_len == 0) {
-            fprintf(stderr, "Can't publish data, there isn't any\n");
+        PriorityQueue *queue = &scheduler->classes[priority];
+        int index = slot - scheduler->slots;
+        slot->priority = priority;
+        slot->pending = true;
+        slot->next = -1;
+        if (queue->tail >= 0) {
+            scheduler->slots[queue->tail].next = index;
         }
         else {
-            mqtt_publish_data(mosq, TOPIC_ALL_DATA_RAW, data_buffer, data_buffer_len);
+            queue->head = index;
+        }
+        queue->tail = index;
+        queue->count++;
+        scheduler->pendingCount++;
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+
+#pragma mark - Command clients
+
+/*
+ * Requests are rate limited with token buckets, so a flood on the request topics can't keep the broker
+ * thread busy answering it. One bucket caps every request the broker takes, whoever sends it. With a
+ * command_rate, clients also get one each, told apart by the last level of their cmd/<command>/<client>
+ * topic, else by their response topic. Those names are picked by the senders, so they only share the
+ * budget fairly among well behaved clients: a client keeps its slot while its bucket refills, names that
+ * find no slot share the overflow bucket, and requests without a name only count against the total.
+ * Each broker keeps a small table of the clients seen lately, only its own thread uses it.
+ */
+#define COMMAND_CLIENT_SLOTS         64
+#define COMMAND_CLIENT_PROBES        8
+
+typedef struct {
+    char                    name[64];           // empty for a free slot
+    double                  tokens;
+    double                  refilledAt;         // monotonic seconds, also when it was last seen
+} CommandClient;
+
+typedef struct {
+    CommandClient           slots[COMMAND_CLIENT_SLOTS];
+    CommandClient           overflow;           // clients that found no slot
+    CommandClient           total;              // every request
+    unsigned long           accepted;
+    unsigned long           limited;
+    unsigned long           rejected;           // unknown commands, oversized payloads
+} CommandClients;
+
+// Refills a bucket up to burst, the tokens it then holds
+double command_bucket_refill(CommandClient *bucket, double rate, double burst, double now) {
+    bucket->tokens += (now - bucket->refilledAt) * rate;
+    bucket->refilledAt = now;
+    if (bucket->tokens > burst) {
+        bucket->tokens = burst;
+    }
+    return bucket->tokens;
+}
+
+bool command_bucket_take(CommandClient *bucket, double rate, double burst, double now) {
+    if (rate <= 0) {
+        return true;
+    }
+    if (command_bucket_refill(bucket, rate, (burst >= 1) ? burst : 1, now) < 1) {
+        return false;
+    }
+    bucket->tokens -= 1;
+    return true;
+}
+
+// The bucket of a named client. Clients not seen before take a free slot near their hash, or one whose
+// bucket has refilled since it was last used; else they share the overflow bucket
+CommandClient *command_client_bucket(CommandClients *clients, const char *name, double rate, double burst, double now) {
+    unsigned int index = topic_hash(name) % COMMAND_CLIENT_SLOTS;
+    CommandClient *idle = NULL;
+    for (int probe = 0; probe < COMMAND_CLIENT_PROBES; probe++, index = (index + 1) % COMMAND_CLIENT_SLOTS) {
+        CommandClient *slot = &clients->slots[index];
+        if (strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+        if ((idle == NULL) && ((slot->name[0] == 0) || (slot->tokens + (now - slot->refilledAt) * rate >= burst))) {
+            idle = slot;
+        }
+    }
+    if (idle == NULL) {
+        return &clients->overflow;
+    }
+    snprintf(idle->name, sizeof(idle->name), "%s", name);
+    idle->tokens = burst;
+    idle->refilledAt = now;
+    return idle;
+}
+
+// Takes a token for a request, false when its client or the broker is over its rate
+bool command_client_admit(CommandClients *clients, const MqttBrokerConfig *config, const char *name, double now) {
+    if ((config->commandRate > 0) && name[0]) {
+        double burst = (config->commandBurst >= 1) ? config->commandBurst : 1;
+        CommandClient *client = command_client_bucket(clients, name, config->commandRate, burst, now);
+        if (!command_bucket_take(client, config->commandRate, burst, now)) {
+            return false;
         }
     }
+    return command_bucket_take(&clients->total, config->commandTotalRate, config->commandTotalBurst, now);
+}
+
+
+#pragma mark - Brokers
+
+/*
+ * Every configured broker has its own mosquitto instance, thread, reconnect backoff, publish queue,
+ * topic aliases and store, so a slow or unreachable broker never holds up the others or the gateway
+ * poll. The poll thread decodes each frame once and queues its messages for every connected broker.
+ */
+typedef struct {
+    MqttBrokerConfig        config;
+    struct mosquitto       *mosq;
+    pthread_t               thread;
+    atomic_bool             connected;
+    atomic_bool             v5Active;
+    atomic_int              inflight;           // handed to libmosquitto, not sent yet
+    TopicAliasTable         aliases;
+    PublishScheduler        scheduler;
+    StoreRing               store;
+    bool                    storeEnabled;
+    atomic_bool             replayQueued;       // the oldest stored snapshot is on its way, see Replay
+    atomic_int              replayMid;          // mid it was handed to libmosquitto with, 0 until then
+    atomic_bool             replayDelivered;
+    uint64_t                replaySequence;     // its seq, poll thread only
+    char                    requestTopic[128];  // full topics of the requests, matched on every message
+    char                    commandPrefix[128];
+    CommandClients          clients;
+    TagPublishState         tagPublish[TAG_COUNT]; // on-change state, poll thread only
+    atomic_bool             tagPublishReset;    // clear tagPublish before the next frame
+    // recovery measurement
+    atomic_bool             awaitingFirstPublish;
+    bool                    everConnected;      // broker thread only, failed first attempts aren't an outage
+    double                  disconnectedAt;     // monotonic seconds, 0 while connected
+    double                  reconnectedAt;
+    unsigned long           reconnects;
+    double                  lastOutage;         // seconds without a broker connection
+    double                  lastRecovery;       // seconds from the reconnect to the first accepted publish
+    // bytes on the wire
+    atomic_ulong            bytesSent;
+    atomic_ulong            bytesWithoutAliases;
+    unsigned long           frameBytesSent;
+    unsigned long           frameBytesWithoutAliases;
+} MqttBroker;
+
+MqttBroker mqtt_brokers[MQTT_MAX_BROKERS];
+
+void broker_first_publish_measured(MqttBroker *broker) {
+    broker->lastRecovery = monotonic_seconds() - broker->reconnectedAt;
+    if (foreground) {
+        printf("First publish to %s %.3f s after reconnecting, it was unreachable for %.1f s\n",
+               broker->config.host, broker->lastRecovery, broker->lastOutage);
+    }
+}
+
+// Connection attempts use the current protocol version, on_connect may have fallen back to 3.1.1
+int broker_connect(MqttBroker *broker) {
+    MqttBrokerConfig *config = &broker->config;
+    if (config->protocolVersion != MQTT_PROTOCOL_V5) {
+        return mosquitto_connect(broker->mosq, config->host, config->port, MQTT_KEEPALIVE_SECONDS);
+    }
+    mosquitto_property *properties = NULL;
+    mosquitto_property_add_int32(&properties, MQTT_PROP_SESSION_EXPIRY_INTERVAL, config->sessionExpiry);
+    int rc = mosquitto_connect_bind_v5(broker->mosq, config->host, config->port, MQTT_KEEPALIVE_SECONDS, NULL, properties);
+    mosquitto_property_free_all(&properties);
+    return rc;
+}
+
+
+#pragma mark -
+
+/*
+ * Where a request came from. MQTT v5 clients can name their own response topic and correlation data,
+ * they then get the response to themselves instead of it going to every subscriber of the broadcast topic.
+ */
+typedef struct {
+    char                   *responseTopic;      // NULL to answer on the broadcast topic
+    void                   *correlationData;
+    uint16_t                correlationLength;
+} MqttRequest;
+
+void mqtt_request_free(MqttRequest *request) {
+    free(request->responseTopic);
+    free(request->correlationData);
+    request->responseTopic = NULL;
+    request->correlationData = NULL;
+    request->correlationLength = 0;
+}
+
+// Publishes on a full topic, responding to request when there is one (no topic alias for those, they are one-offs)
+int mqtt_publish_on_topic(MqttBroker *broker, const char *full_topic, const void *payload, int payload_len, const PublishOptions *options,
+                          const MqttRequest *request) {
+    if (foreground && verbose) {
+        printf("Publishing on topic %s qos %d%s\n", full_topic, options->qos, options->retain ? " retained" : "");
+    }
+    int rc;
+    int mid = 0;
+    bool v5 = atomic_load(&broker->v5Active);
+    size_t topic_length = strlen(full_topic);
+    size_t properties_length = 0;
+    if (v5) {
+        mosquitto_property *properties = NULL;
+        const char *topic = full_topic;
+        if (options->expiry > 0) {
+            // let the broker drop readings nobody picked up in time instead of queueing them for offline subscribers
+            mosquitto_property_add_int32(&properties, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, options->expiry);
+            properties_length += 5;
+        }
+        if (options->contentType) {
+            mosquitto_property_add_string(&properties, MQTT_PROP_CONTENT_TYPE, options->contentType);
+            properties_length += 3 + strlen(options->contentType);
+        }
+        if (request && request->correlationData) {
+            mosquitto_property_add_binary(&properties, MQTT_PROP_CORRELATION_DATA, request->correlationData, request->correlationLength);
+            properties_length += 3 + request->correlationLength;
+        }
+        bool assigned = false;
+        bool aliased = broker->config.topicAliases && (options->qos == 0) && !request;
+        if (aliased) {
+            pthread_mutex_lock(&broker->aliases.lock);
+        }
+        int alias = aliased ? topic_alias_lookup(&broker->aliases, full_topic, &assigned) : 0;
+        if (alias) {
+            mosquitto_property_add_int16(&properties, MQTT_PROP_TOPIC_ALIAS, alias);
+            properties_length += 3;
+            if (!assigned) {
+                topic = NULL;
+            }
+        }
+        atomic_fetch_add(&broker->inflight, 1);
+        rc = mosquitto_publish_v5(broker->mosq, &mid, topic, payload_len, payload, options->qos, options->retain, properties);
+        if (assigned && (rc != MOSQ_ERR_SUCCESS)) {
+            topic_alias_forget(&broker->aliases, full_topic);
+        }
+        if (aliased) {
+            pthread_mutex_unlock(&broker->aliases.lock);
+        }
+        mosquitto_property_free_all(&properties);
+        atomic_fetch_add(&broker->bytesSent, mqtt_publish_packet_size(topic ? topic_length : 0, payload_len, properties_length, options->qos, true));
+        atomic_fetch_add(&broker->bytesWithoutAliases, mqtt_publish_packet_size(topic_length, payload_len, properties_length - (alias ? 3 : 0), options->qos, true));
+    }
+    else {
+        atomic_fetch_add(&broker->inflight, 1);
+        rc = mosquitto_publish(broker->mosq, &mid, full_topic, payload_len, payload, options->qos, options->retain);
+        size_t size = mqtt_publish_packet_size(topic_length, payload_len, 0, options->qos, false);
+        atomic_fetch_add(&broker->bytesSent, size);
+        atomic_fetch_add(&broker->bytesWithoutAliases, size);
+    }
+    if (rc != MOSQ_ERR_SUCCESS) {
+        atomic_fetch_sub(&broker->inflight, 1);
+        fprintf(stderr, "Error publishing message to %s: %s\n", broker->config.host, mosquitto_strerror(rc));
+    }
+    else if (atomic_exchange(&broker->awaitingFirstPublish, false)) {
+        broker_first_publish_measured(broker);
+    }
+    if (options->replay) {
+        // lost with the scheduler slot when it failed: the poll thread queues it again from the store
+        atomic_store(&broker->replayMid, (rc == MOSQ_ERR_SUCCESS) ? mid : 0);
+        if (rc != MOSQ_ERR_SUCCESS) {
+            atomic_store(&broker->replayQueued, false);
+        }
+    }
+    return rc;
+}
+
+int mqtt_publish_with_options(MqttBroker *broker, const char *topic_suffix, const void *payload, int payload_len, const PublishOptions *options) {
+    char full_topic[192]; // base topic, / and a suffix of up to 127
+    snprintf(full_topic, sizeof(full_topic), "%s/%s", broker->config.baseTopic, topic_suffix);
+    return mqtt_publish_on_topic(broker, full_topic, payload, payload_len, options, NULL);
+}
+
+// Answers a request on its response topic, or on the broadcast topic_suffix when it didn't give one
+int mqtt_respond(MqttBroker *broker, const MqttRequest *request, const char *topic_suffix, const void *payload, int payload_len,
+                 const PublishOptions *options) {
+    if (request && request->responseTopic) {
+        return mqtt_publish_on_topic(broker, request->responseTopic, payload, payload_len, options, request);
+    }
+    return mqtt_publish_with_options(broker, topic_suffix, payload, payload_len, options);
+}
+
+int mqtt_publish_data(MqttBroker *broker, const char *topic_suffix, const void *payload, int payload_len) {
+    return mqtt_publish_with_options(broker, topic_suffix, payload, payload_len, &default_publish_options);
+}
+
+void mqtt_publish(MqttBroker *broker, const char *topic_suffix, const char *payload) {
+    mqtt_publish_data(broker, topic_suffix, payload, strlen(payload));
+}
+
+void mqtt_subscribe(MqttBroker *broker, const char *topic_suffix) {
+    char full_topic[128];
+    snprintf(full_topic, sizeof(full_topic), "%s/%s", broker->config.baseTopic, topic_suffix);
+    if (foreground && verbose) {
+        printf("Subscribing to topic %s\n", full_topic);
+    }
+    int rc = mosquitto_subscribe(broker->mosq, NULL, full_topic, 0);
+    if (rc != MOSQ_ERR_SUCCESS) {
+        fprintf(stderr, "Error subscribing to topic %s: %s\n", full_topic, mosquitto_strerror(rc));
+    }
+}
+
+// Sends what the buckets and the in-flight limit allow, highest class first
+void publish_scheduler_drain(MqttBroker *broker) {
+    if (!atomic_load(&broker->connected)) {
+        return;
+    }
+    PublishScheduler *scheduler = &broker->scheduler;
+    int max_inflight = broker->config.maxInflight;
+    pthread_mutex_lock(&scheduler->lock);
+    double now = monotonic_seconds();
+    time_t wallclock = time(NULL);
+    for (int pc = 0; pc < PRIORITY_COUNT; pc++) {
+        PriorityQueue *queue = &scheduler->classes[pc];
+        while (queue->count > 0) {
+            PendingPublish *slot = &scheduler->slots[queue->head];
+            if (slot->coalesce && (slot->options.expiry > 0) && (wallclock - slot->queuedAt > slot->options.expiry)) {
+                // waited longer than it's worth reading, on-change tags go out in full with the next frame
+                priority_queue_pop(scheduler, queue);
+                queue->shed++;
+                atomic_store(&scheduler->shed, true);
+                continue;
+            }
+            if ((max_inflight > 0) && (atomic_load(&broker->inflight) >= max_inflight)) {
+                break; // the link is behind, what waits here can still be replaced by newer values
+            }
+            if (!priority_queue_take_token(queue, now)) {
+                queue->deferred++;
+                break;
+            }
+            mqtt_publish_with_options(broker, slot->topic, slot->payload, slot->length, &slot->options);
+            priority_queue_pop(scheduler, queue);
+            queue->sent++;
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+// Queues a frame message for every connected broker
+void publish_frame_message(PRIORITY_CLASS priority, const char *topic_suffix, const void *payload, int length, const PublishOptions *options) {
+    for (int bi = 0; bi < mqtt_broker_count; bi++) {
+        if (atomic_load(&mqtt_brokers[bi].connected)) {
+            publish_scheduler_enqueue(&mqtt_brokers[bi].scheduler, priority, topic_suffix, payload, length, options);
+        }
+    }
+}
+
+// Owns the connection of one broker: runs its network loop while connected and reconnects with jittered
+// exponential backoff when it's lost, so neither the poll thread nor the other brokers wait for it
+void *broker_thread(void *arg) {
+    MqttBroker *broker = arg;
+    int minimum = (broker->config.reconnectMin > 0) ? broker->config.reconnectMin : 1;
+    int maximum = (broker->config.reconnectMax > minimum) ? broker->config.reconnectMax : minimum;
+    double backoff = minimum;
+    unsigned int seed = time(NULL) ^ getpid() ^ (unsigned int)(broker - mqtt_brokers);
+    while (1) {
+        int rc = broker_connect(broker);
+        if (rc == MOSQ_ERR_SUCCESS) {
+            while ((rc = mosquitto_loop(broker->mosq, SCHEDULER_DRAIN_MS, 1)) == MOSQ_ERR_SUCCESS) {
+                // sends what waited for tokens
+                publish_scheduler_drain(broker);
+            }
+            if (broker->reconnectedAt > 0) {
+                // the connection was up, start over from the shortest delay
+                backoff = minimum;
+            }
+        }
+        if (foreground) {
+            fprintf(stderr, "Broker %s connection: %s\n", broker->config.host, mosquitto_strerror(rc));
+        }
+        atomic_store(&broker->connected, false);
+        if (broker->disconnectedAt == 0) {
+            broker->disconnectedAt = monotonic_seconds();
+        }
+        broker->reconnectedAt = 0;
+        // half the backoff plus a random part of the other half, so clients don't retry in step
+        double delay = backoff / 2 + (backoff / 2) * rand_r(&seed) / RAND_MAX;
+        if (foreground && verbose) {
+            printf("Reconnecting to %s in %.1f s\n", broker->config.host, delay);
+        }
+        usleep(delay * 1e6);
+        backoff = (backoff * 2 < maximum) ? backoff * 2 : maximum;
+    }
+    return NULL;
+}
+
+
+#pragma mark - Request handlers
+
+void publish_raw(MqttBroker *broker, const MqttRequest *request) {
+    time_t now;
+    time(&now);
+    RawFrameSlot *slot = raw_frame_acquire();
+    if (slot == NULL) {
+        fprintf(stderr, "Can't publish data, there isn't any\n");
+    }
+    else if ((now - slot->timestamp) > MESSAGE_EXPIRATION_SECONDS) {
+        fprintf(stderr, "Can't publish data, it's stale. Haven't received an update in %ld seconds\n", now - slot->timestamp);
+    }
+    else {
+        if (foreground && verbose) {
+            printf("Publishing raw frame generation %lu\n", slot->generation);
+        }
+        FrameCursor frame = cursor_make(slot->data, slot->length);
+        mqtt_respond(broker, request, TOPIC_ALL_DATA_RAW, frame.data, frame.remaining, &default_publish_options);
+    }
+    if (slot) {
+        raw_frame_release(slot);
+    }
+}
+
+/*
+ * The all_data/json response is serialized once per committed frame and kept, every request until the
+ * next frame (or until its oldest value goes stale) publishes the cached text as is. The buffer is sized
+ * from the tag table, so it holds every tag at its longest message.
+ */
+typedef struct {
+    pthread_mutex_t         lock;
+    char                   *buffer;
+    size_t                  capacity;
+    size_t                  length;             // 0 when there is nothing recent to publish
+    bool                    valid;
+    unsigned int            sequence;           // tag state sequence it was built from
+    unsigned long           generation;         // frame it holds
+    time_t                  validUntil;         // when its oldest value goes stale
+    time_t                  builtAt;            // values stale by then were left out
+} JsonResponseCache;
+
+JsonResponseCache json_response_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+size_t json_response_capacity(void) {
+    size_t capacity = 64; // generation and braces
+    for (int ti = 0; ti < tag_count(); ti++) {
+        capacity += strlen(tagData[ti].topic) + MQTT_MESSAGE_MAXLEN + 8;
+    }
+    return capacity;
+}
+
+// Rebuilds the cached response from the current tag state, called with the cache locked
+void json_response_build(JsonResponseCache *cache, time_t now) {
+    static FrameSnapshot snapshot;
+    cache->valid = false;
+    if (cache->buffer == NULL) {
+        cache->capacity = json_response_capacity();
+        cache->buffer = malloc(cache->capacity);
+        if (cache->buffer == NULL) {
+            fprintf(stderr, "Could not allocate the json response buffer\n");
+            return;
+        }
+    }
+    cache->sequence = tag_state_snapshot(&snapshot);
+    cache->generation = snapshot.generation;
+    cache->validUntil = now + MESSAGE_EXPIRATION_SECONDS;
+    cache->builtAt = now;
+    TextBuilder json = text_builder(cache->buffer, cache->capacity);
+    text_append(&json, "{\n\"generation\": %lu", snapshot.generation);
+    bool firstTopic = true;
+    for (int ti = tag_count() -1; ti >= 0; ti--) {
+        TagState *state = &snapshot.tags[ti];
+        if (state->lastMessage[0] && ((now - state->lastMessageTimestamp) <= MESSAGE_EXPIRATION_SECONDS)) {
+            firstTopic = false;
+            text_append(&json, ",\n\"%s\": \"%s\"", tagData[ti].topic, state->lastMessage);
+            if (state->lastMessageTimestamp + MESSAGE_EXPIRATION_SECONDS < cache->validUntil) {
+                cache->validUntil = state->lastMessageTimestamp + MESSAGE_EXPIRATION_SECONDS;
+            }
+        }
+    }
+    text_append(&json, "\n}");
+    if (json.overflow) {
+        fprintf(stderr, "JSON response doesn't fit in %zu bytes\n", cache->capacity);
+        return;
+    }
+    cache->length = firstTopic ? 0 : json.length;
+    cache->valid = true;
+}
+
+// Rebuilds the cached response if the tag state moved on or a value went stale, called with the cache
+// locked. True when it holds a response
+bool json_response_current(JsonResponseCache *cache) {
+    time_t now;
+    time(&now);
+    if (!cache->valid || (cache->sequence != atomic_load_explicit(&tag_state_sequence, memory_order_acquire)) || (now > cache->validUntil)) {
+        json_response_build(cache, now);
+    }
+    if (cache->valid && !cache->length) {
+        fprintf(stderr, "No recent data to publish\n");
+    }
+    return cache->valid && cache->length;
+}
+
+void publish_json(MqttBroker *broker, const MqttRequest *request) {
+    JsonResponseCache *cache = &json_response_cache;
+    pthread_mutex_lock(&cache->lock);
+    if (json_response_current(cache)) {
+        mqtt_respond(broker, request, TOPIC_ALL_DATA_JSON, cache->buffer, cache->length, &default_publish_options);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Tags selected by a list of topics or topic prefixes ending in *, separated by spaces or commas, in the
+// order of the list, each once
+int tag_selection(const char *filter, int *tags) {
+    bool selected[TAG_COUNT] = { false };
+    int count = 0;
+    char list[256];
+    snprintf(list, sizeof(list), "%s", filter);
+    char *context = NULL;
+    for (char *pattern = strtok_r(list, " ,", &context); pattern; pattern = strtok_r(NULL, " ,", &context)) {
+        const int *matches = NULL;
+        int matched = tag_topic_match(pattern, &matches);
+        for (int i = 0; i < matched; i++) {
+            if (!selected[matches[i]]) {
+                selected[matches[i]] = true;
+                tags[count++] = matches[i];
+            }
+        }
+    }
+    return count;
+}
+
+// publish_json for the tags selected by filter only, built for the request: the work and the response
+// size follow the number of selected tags. Without a response topic it goes on its own topic, subscribers
+// of all_data/json expect every tag
+void publish_json_filtered(MqttBroker *broker, const MqttRequest *request, const char *filter) {
+    int tags[TAG_COUNT];
+    int count = tag_selection(filter, tags);
+    if (count == 0) {
+        fprintf(stderr, "No tag matches %s\n", filter);
+        return;
+    }
+    FrameSnapshot snapshot;
+    tag_state_read(&snapshot, tags, count);
+    size_t capacity = 64;
+    for (int i = 0; i < count; i++) {
+        capacity += strlen(tagData[tags[i]].topic) + MQTT_MESSAGE_MAXLEN + 8;
+    }
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        fprintf(stderr, "Could not allocate the json response buffer\n");
+        return;
+    }
+    time_t now;
+    time(&now);
+    TextBuilder json = text_builder(buffer, capacity);
+    text_append(&json, "{\n\"generation\": %lu", snapshot.generation);
+    bool firstTopic = true;
+    for (int i = 0; i < count; i++) {
+        TagState *state = &snapshot.tags[tags[i]];
+        if (state->lastMessage[0] && ((now - state->lastMessageTimestamp) <= MESSAGE_EXPIRATION_SECONDS)) {
+            firstTopic = false;
+            text_append(&json, ",\n\"%s\": \"%s\"", tagData[tags[i]].topic, state->lastMessage);
+        }
+    }
+    text_append(&json, "\n}");
+    if (firstTopic) {
+        fprintf(stderr, "No recent data to publish for %s\n", filter);
+    }
+    else {
+        mqtt_respond(broker, request, TOPIC_ALL_DATA_JSON_FILTERED, json.buffer, json.length, &default_publish_options);
+    }
+    free(buffer);
+}
+
+// The same recent values as publish_json, as typed CBOR: {"generation": n, "values": {topic: value}}
+void publish_cbor(MqttBroker *broker, const MqttRequest *request) {
+    time_t now;
+    time(&now);
+    FrameSnapshot snapshot;
+    tag_state_snapshot(&snapshot);
+    uint8_t cbor_buffer[TAG_COUNT * 48 + 64];
+    CborWriter cbor = cbor_writer(cbor_buffer, sizeof(cbor_buffer));
+    cbor_put_map(&cbor, 2);
+    cbor_put_text(&cbor, "generation");
+    cbor_put_uint(&cbor, snapshot.generation);
+    cbor_put_text(&cbor, "values");
+    cbor_put_map_begin(&cbor);
+    bool firstTopic = true;
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagState *state = &snapshot.tags[ti];
+        if (state->lastMessage[0] && ((now - state->lastMessageTimestamp) <= MESSAGE_EXPIRATION_SECONDS)) {
+            firstTopic = false;
+            cbor_put_text(&cbor, tagData[ti].topic);
+            if (state->numeric) {
+                cbor_put_tag_value(&cbor, &state->value);
+            }
+            else {
+                cbor_put_text(&cbor, state->lastMessage);
+            }
+        }
+    }
+    cbor_put_end(&cbor);
+    if (firstTopic) {
+        fprintf(stderr, "No recent data to publish\n");
+    }
+    else if (cbor.overflow) {
+        fprintf(stderr, "CBOR response doesn't fit in %zu bytes\n", sizeof(cbor_buffer));
+    }
+    else {
+        PublishOptions options = default_publish_options;
+        options.contentType = CONTENT_TYPE_CBOR;
+        mqtt_respond(broker, request, TOPIC_ALL_DATA_CBOR, cbor.buffer, cbor.length, &options);
+    }
+}
+
+
+
+#pragma mark - History queries
+
+size_t history_total_bytes(void) {
+    size_t bytes = 0;
+    pthread_rwlock_rdlock(&history_lock);
+    for (int ti = 0; ti < tag_count(); ti++) {
+        bytes += history_bytes(&history_series[ti]);
+    }
+    pthread_rwlock_unlock(&history_lock);
+    return bytes;
+}
+
+typedef struct {
+    TextBuilder            *json;
+    int                     exponent;
+    bool                    first;
+} HistoryResponse;
+
+void history_response_point(void *context, int64_t timestamp, int32_t value) {
+    HistoryResponse *response = context;
+    TagValue point = { .value = value, .exponent = response->exponent };
+    text_append(response->json, "%s[%lld,%.*f]", response->first ? "" : ",", (long long)timestamp,
+                (point.exponent < 0) ? -point.exponent : 0, tag_value_as_double(&point));
+    response->first = false;
+}
+
+// "<topic> <seconds>": the values of a tag over the last seconds, as {"topic":..,"points":[[ts,value],..]}
+void publish_history(MqttBroker *broker, const MqttRequest *request, const char *arguments) {
+    char topic[128];
+    long seconds = 0;
+    const int *tags = NULL;
+    if ((sscanf(arguments, "%127s %ld", topic, &seconds) != 2) || (seconds <= 0)) {
+        fprintf(stderr, "History request needs a topic and a number of seconds: %s\n", arguments);
+        return;
+    }
+    if ((tag_topic_match(topic, &tags) != 1) || (topic[strlen(topic) - 1] == '*')) {
+        fprintf(stderr, "No history for %s\n", topic);
+        return;
+    }
+    int ti = tags[0];
+    time_t now;
+    time(&now);
+    pthread_rwlock_rdlock(&history_lock);
+    uint64_t count = history_query(&history_series[ti], now - seconds, 0, NULL, NULL);
+    uint64_t skip = (count > HISTORY_MAX_POINTS) ? count - HISTORY_MAX_POINTS : 0;
+    size_t capacity = 128 + strlen(topic) + (count - skip) * 32;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        pthread_rwlock_unlock(&history_lock);
+        fprintf(stderr, "Could not allocate the history response buffer\n");
+        return;
+    }
+    TextBuilder json = text_builder(buffer, capacity);
+    HistoryResponse response = { .json = &json, .exponent = tagTypeExponent(tagData[ti].type), .first = true };
+    text_append(&json, "{\"topic\":\"%s\",\"truncated\":%s,\"points\":[", topic, skip ? "true" : "false");
+    history_query(&history_series[ti], now - seconds, skip, history_response_point, &response);
+    pthread_rwlock_unlock(&history_lock);
+    text_append(&json, "]}");
+    if (json.overflow) {
+        fprintf(stderr, "History response doesn't fit in %zu bytes\n", capacity);
+    }
+    else {
+        mqtt_respond(broker, request, TOPIC_ALL_DATA_HISTORY, json.buffer, json.length, &default_publish_options);
+    }
+    free(buffer);
+}
+
+
+#pragma mark - Delta
+
+/*
+ * With delta = on in [publish], every frame is also published on <base_topic>/delta with only the tags
+ * whose value changed, the frame's seq and the seq of the frame before it as prev. Tags the previous frame
+ * had and this one hasn't are sent as null, so the state a subscriber builds is always the tags of the
+ * last frame. prev moves on with every frame, published or not (no broker connected, a delta that didn't
+ * fit), so the frames whose delta never went out show up as a gap. A subscriber that gets a prev other
+ * than the last seq it applied missed some, sends "resync" and gets the whole state on
+ * <base_topic>/delta/full, then goes on with the deltas that come after its seq. Deltas are sequenced messages for the scheduler: never replaced by the next one nor shed.
+ * Both are written like the snapshot: {"seq": n, "prev": p, "ts": t, "values": {topic: value}}, as JSON
+ * or CBOR following the payload format.
+ */
+unsigned long delta_previous = 0;               // seq of the last frame committed, poll thread only
+
+// Upper bound of the snapshot message size, from the tag table
+size_t snapshot_capacity(void) {
+    size_t capacity = 128; // sequence number, timestamp and braces
+    for (int ti = 0; ti < tag_count(); ti++) {
+        capacity += strlen(tagData[ti].topic) + MQTT_MESSAGE_MAXLEN + 8;
+        if (tagData[ti].type == TAG_TYPE_3_BYTES_TEMP_AND_BATT) {
+            capacity += strlen(tagData[ti].topic) + MQTT_MESSAGE_MAXLEN + 16;
+        }
+    }
+    return capacity;
+}
+
+// Options for snapshot messages, flagged as CBOR when they are
+PublishOptions snapshot_publish_options(void) {
+    PublishOptions options = default_publish_options;
+    if (payload_format == PAYLOAD_CBOR) {
+        options.contentType = CONTENT_TYPE_CBOR;
+    }
+    return options;
+}
+
+typedef struct {
+    bool                    cbor;
+    TextBuilder             json;
+    CborWriter              binary;
+    bool                    first;
+} StateWriter;
+
+StateWriter state_writer(void *buffer, size_t capacity) {
+    StateWriter writer = { .cbor = (payload_format == PAYLOAD_CBOR), .first = true };
+    if (writer.cbor) {
+        writer.binary = cbor_writer(buffer, capacity);
+    }
+    else {
+        writer.json = text_builder(buffer, capacity);
+    }
+    return writer;
+}
+
+// previous is NULL for a full state
+void state_writer_begin(StateWriter *writer, unsigned long sequence, const unsigned long *previous, time_t timestamp) {
+    if (!writer->cbor) {
+        text_append(&writer->json, "{\"seq\":%lu,", sequence);
+        if (previous) {
+            text_append(&writer->json, "\"prev\":%lu,", *previous);
+        }
+        text_append(&writer->json, "\"ts\":%ld,\"values\":{", (long)timestamp);
+        return;
+    }
+    cbor_put_map(&writer->binary, previous ? 4 : 3);
+    cbor_put_text(&writer->binary, "seq");
+    cbor_put_uint(&writer->binary, sequence);
+    if (previous) {
+        cbor_put_text(&writer->binary, "prev");
+        cbor_put_uint(&writer->binary, *previous);
+    }
+    cbor_put_text(&writer->binary, "ts");
+    cbor_put_int(&writer->binary, timestamp);
+    cbor_put_text(&writer->binary, "values");
+    cbor_put_map_begin(&writer->binary);
+}
+
+// A tag gone from the frame, null
+void state_writer_removed(StateWriter *writer, int ti) {
+    if (!writer->cbor) {
+        text_append(&writer->json, "%s\"%s\":null", writer->first ? "" : ",", tagData[ti].topic);
+    }
+    else {
+        cbor_put_text(&writer->binary, tagData[ti].topic);
+        cbor_put_null(&writer->binary);
+    }
+    writer->first = false;
+}
+
+void state_writer_value(StateWriter *writer, int ti, const char *message, bool numeric, const TagValue *value) {
+    if (!writer->cbor) {
+        const char *quote = numeric ? "" : "\"";
+        text_append(&writer->json, "%s\"%s\":%s%s%s", writer->first ? "" : ",", tagData[ti].topic, quote, message, quote);
+    }
+    else {
+        cbor_put_text(&writer->binary, tagData[ti].topic);
+        if (numeric) {
+            cbor_put_tag_value(&writer->binary, value);
+        }
+        else {
+            cbor_put_text(&writer->binary, message);
+        }
+    }
+    writer->first = false;
+}
+
+// Closes the message, false when it didn't fit
+bool state_writer_end(StateWriter *writer, const void **payload, size_t *length) {
+    if (!writer->cbor) {
+        text_append(&writer->json, "}}");
+        *payload = writer->json.buffer;
+        *length = writer->json.length;
+        return !writer->json.overflow;
+    }
+    cbor_put_end(&writer->binary);
+    *payload = writer->binary.buffer;
+    *length = writer->binary.length;
+    return !writer->binary.overflow;
+}
+
+// The whole current state on delta/full, for subscribers that missed a delta
+void publish_resync(MqttBroker *broker, const MqttRequest *request) {
+    FrameSnapshot snapshot;
+    tag_state_snapshot(&snapshot);
+    size_t capacity = snapshot_capacity();
+    void *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        fprintf(stderr, "Could not allocate the resync buffer\n");
+        return;
+    }
+    StateWriter writer = state_writer(buffer, capacity);
+    state_writer_begin(&writer, snapshot.generation, NULL, snapshot.timestamp);
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagState *state = &snapshot.tags[ti];
+        if (state->lastMessage[0] && (state->lastGeneration == snapshot.generation)) {
+            state_writer_value(&writer, ti, state->lastMessage, state->numeric, &state->value);
+        }
+    }
+    const void *payload;
+    size_t length;
+    if (state_writer_end(&writer, &payload, &length)) {
+        PublishOptions options = snapshot_publish_options();
+        mqtt_respond(broker, request, TOPIC_DELTA_FULL, payload, length, &options);
+    }
+    else {
+        fprintf(stderr, "Resync doesn't fit in %zu bytes\n", capacity);
+    }
+    free(buffer);
+}
+
+#pragma mark - Refresh
+
+/*
+ * A "refresh" request wakes the poll thread for an immediate gateway poll, and is answered with the
+ * all_data/json response once that poll is done. Single flight: requests arriving while a poll is
+ * pending join it, so any number of them cost one gateway query. A request arriving once the poll has
+ * started would get a frame older than itself from it, so it waits for the next poll, which then starts
+ * right away. Broadcast requests get one response per broker, requests with a response topic one each.
+ * When the poll fails its requests are not answered with an older frame: they wait for the next poll that
+ * succeeds, for up to REFRESH_TIMEOUT_SECONDS, and are dropped unanswered after that like failed gateway reads.
+ */
+#define REFRESH_MAX_WAITERS          32
+#define REFRESH_TIMEOUT_SECONDS      60
+
+typedef struct {
+    MqttBroker             *broker;
+    MqttRequest             request;            // owned, freed once answered
+    unsigned long           generation;         // refresh_generation when it was asked, answered by a later poll
+    double                  requestedAt;        // monotonic
+} RefreshWaiter;
+
+pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t refresh_wake;                    // on CLOCK_MONOTONIC, signalled when a poll is requested
+bool refresh_requested = false;
+bool gateway_requested = false;                 // gateway reads are waiting to run, see Gateway commands
+unsigned long refresh_generation = 0;           // polls started
+unsigned int refresh_broadcasts = 0;            // brokers to answer on the broadcast topic after the next poll, one bit each
+unsigned int refresh_answering = 0;             // same, asked before the running poll started
+double refresh_broadcasts_since = 0;            // monotonic time of the oldest request of each set
+double refresh_answering_since = 0;
+RefreshWaiter refresh_waiters[REFRESH_MAX_WAITERS];
+int refresh_waiter_count = 0;
+atomic_ulong refresh_polls = 0;
+atomic_ulong refresh_coalesced = 0;
+
+void refresh_init(void) {
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&refresh_wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+}
+
+// Takes over the response topic and correlation data of request
+void refresh_request(MqttBroker *broker, MqttRequest *request) {
+    pthread_mutex_lock(&refresh_lock);
+    if (refresh_requested) {
+        // a poll is already on its way, this request gets its answer
+        atomic_fetch_add(&refresh_coalesced, 1);
+    }
+    else {
+        refresh_requested = true;
+        atomic_fetch_add(&refresh_polls, 1);
+        pthread_cond_signal(&refresh_wake);
+    }
+    if (request->responseTopic && (refresh_waiter_count < REFRESH_MAX_WAITERS)) {
+        RefreshWaiter *waiter = &refresh_waiters[refresh_waiter_count++];
+        waiter->broker = broker;
+        waiter->request = *request;
+        waiter->generation = refresh_generation;
+        waiter->requestedAt = monotonic_seconds();
+        *request = (MqttRequest){ 0 };
+    }
+    else {
+        // legacy requests, and requesters past the limit, are answered on the broadcast topic
+        if (refresh_broadcasts == 0) {
+            refresh_broadcasts_since = monotonic_seconds();
+        }
+        refresh_broadcasts |= 1u << (broker - mqtt_brokers);
+    }
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+// Sleeps for up to seconds, true when a refresh request is pending. Gateway commands cut it short too,
+// returning false
+bool refresh_wait(double seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    long nanoseconds = deadline.tv_nsec + (long)((seconds - (long)seconds) * 1e9);
+    deadline.tv_sec += (long)seconds + nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    pthread_mutex_lock(&refresh_lock);
+    while (!refresh_requested && !gateway_requested && (pthread_cond_timedwait(&refresh_wake, &refresh_lock, &deadline) != ETIMEDOUT)) {
+    }
+    bool requested = refresh_requested;
+    pthread_mutex_unlock(&refresh_lock);
+    return requested;
+}
+
+// Called by the poll thread when a poll starts: the requests pending so far are the ones it answers
+void refresh_poll_begin(void) {
+    pthread_mutex_lock(&refresh_lock);
+    refresh_generation++;
+    if (refresh_answering == 0) {
+        refresh_answering_since = refresh_broadcasts_since;
+    }
+    refresh_answering |= refresh_broadcasts;
+    refresh_broadcasts = 0;
+    refresh_requested = false;
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+// Called by the poll thread after each poll: when it read a frame, answers the requests that were made
+// before it started with it. Those made while it ran stay for the next poll, already requested. When it
+// failed, its requests wait for the next poll too, unless they waited too long already
+void refresh_answer(bool polled) {
+    static RefreshWaiter waiters[REFRESH_MAX_WAITERS];
+    double expired = monotonic_seconds() - REFRESH_TIMEOUT_SECONDS;
+    pthread_mutex_lock(&refresh_lock);
+    unsigned int broadcasts = 0;
+    if (polled || (refresh_answering_since < expired)) {
+        broadcasts = refresh_answering;
+        refresh_answering = 0;
+    }
+    int count = 0;
+    int kept = 0;
+    for (int wi = 0; wi < refresh_waiter_count; wi++) {
+        RefreshWaiter *waiter = &refresh_waiters[wi];
+        if ((waiter->generation < refresh_generation) && (polled || (waiter->requestedAt < expired))) {
+            waiters[count++] = *waiter;
+        }
+        else {
+            refresh_waiters[kept++] = *waiter;
+        }
+    }
+    refresh_waiter_count = kept;
+    pthread_mutex_unlock(&refresh_lock);
+    if (!polled && (broadcasts || count)) {
+        fprintf(stderr, "No gateway frame for %d s, refresh requests dropped unanswered\n", REFRESH_TIMEOUT_SECONDS);
+    }
+    for (int bi = 0; (bi < mqtt_broker_count) && broadcasts && polled; bi++) {
+        if (broadcasts & (1u << bi)) {
+            publish_json(&mqtt_brokers[bi], NULL);
+        }
+    }
+    for (int wi = 0; wi < count; wi++) {
+        if (polled) {
+            publish_json(waiters[wi].broker, &waiters[wi].request);
+        }
+        mqtt_request_free(&waiters[wi].request);
+    }
+}
+
+
+#pragma mark - Gateway commands
+
+/*
+ * "gateway <read>" (or cmd/gateway with the read as payload) answers with the reply frame of that gateway
+ * command on <base_topic>/gateway/<read>, like all_data/raw. The reads are run by the poll thread between
+ * two polls, so the gateway never sees another connection than the daemon's own, and each reply is kept
+ * for command_ttl seconds: requests within that time are answered from it, and those arriving while a
+ * read is pending share it. Only reads are exposed. The queue is guarded by refresh_lock, requests wake
+ * the poll thread through refresh_wake.
+ */
+#define GATEWAY_MAX_WAITERS          32
+
+typedef struct {
+    const char             *name;
+    unsigned char           command;
+    unsigned char           reply[RECEIVE_BUFFER_SIZE];
+    int                     length;             // 0 until read
+    double                  fetchedAt;          // monotonic
+    bool                    pending;
+    unsigned int            broadcasts;         // brokers to answer on the gateway topic, one bit each
+} GatewayCommand;
+
+GatewayCommand gateway_commands[] = {
+    { .name = "calibration",      .command = CMD_READ_CALIBRATION },
+    { .name = "rain",             .command = CMD_READ_RAINDATA },
+    { .name = "sensor_id",        .command = CMD_READ_SENSOR_ID_NEW },
+    { .name = "rain_gain",        .command = CMD_READ_GAIN },
+    { .name = "offsets",          .command = CMD_GET_MulCH_OFFSET },
+    { .name = "pm25_offset",      .command = CMD_GET_PM25_OFFSET },
+    { .name = "co2_offset",       .command = CMD_GET_CO2_OFFSET },
+    { .name = "soil_calibration", .command = CMD_GET_SOILHUMIAD },
+    { .name = "firmware",         .command = CMD_READ_FIRMWARE_VERSION },
+    { .name = "mac",              .command = CMD_READ_SATION_MAC },
+};
+
+#define GATEWAY_COMMAND_COUNT        (int)(sizeof(gateway_commands) / sizeof(gateway_commands[0]))
+
+typedef struct {
+    MqttBroker             *broker;
+    MqttRequest             request;            // owned, freed once answered
+    GatewayCommand         *command;
+} GatewayWaiter;
+
+GatewayWaiter gateway_waiters[GATEWAY_MAX_WAITERS];
+int gateway_waiter_count = 0;
+atomic_ulong gateway_reads = 0;
+atomic_ulong gateway_cached = 0;
+
+GatewayCommand *gateway_command_named(const char *name) {
+    for (int ci = 0; ci < GATEWAY_COMMAND_COUNT; ci++) {
+        if (strcmp(gateway_commands[ci].name, name) == 0) {
+            return &gateway_commands[ci];
+        }
+    }
+    return NULL;
+}
+
+void publish_gateway_reply(MqttBroker *broker, const MqttRequest *request, const GatewayCommand *command, const unsigned char *reply, int length) {
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), TOPIC_GATEWAY "%s", command->name);
+    mqtt_respond(broker, request, suffix, reply, length, &default_publish_options);
+}
+
+// Takes over the response topic and correlation data of request when the reply has to be read first
+void gateway_request(MqttBroker *broker, MqttRequest *request, const char *name) {
+    GatewayCommand *command = gateway_command_named(name);
+    if (command == NULL) {
+        fprintf(stderr, "Unknown gateway command %s\n", name);
+        return;
+    }
+    unsigned char reply[RECEIVE_BUFFER_SIZE];
+    int length = 0;
+    pthread_mutex_lock(&refresh_lock);
+    if (command->length && ((monotonic_seconds() - command->fetchedAt) < gateway_command_ttl)) {
+        length = command->length;
+        memcpy(reply, command->reply, length);
+    }
+    else {
+        if (!command->pending) {
+            command->pending = true;
+            gateway_requested = true;
+            pthread_cond_signal(&refresh_wake);
+        }
+        if (request->responseTopic && (gateway_waiter_count < GATEWAY_MAX_WAITERS)) {
+            GatewayWaiter *waiter = &gateway_waiters[gateway_waiter_count++];
+            waiter->broker = broker;
+            waiter->request = *request;
+            waiter->command = command;
+            *request = (MqttRequest){ 0 };
+        }
+        else {
+            command->broadcasts |= 1u << (broker - mqtt_brokers);
+        }
+    }
+    pthread_mutex_unlock(&refresh_lock);
+    if (length) {
+        atomic_fetch_add(&gateway_cached, 1);
+        publish_gateway_reply(broker, request, command, reply, length);
+    }
+}
+
+// Called by the poll thread once a read is done, length 0 when it failed: keeps the reply and answers
+// the requests waiting for it
+void gateway_complete(GatewayCommand *command, const unsigned char *reply, int length) {
+    static GatewayWaiter waiters[GATEWAY_MAX_WAITERS];
+    int count = 0;
+    pthread_mutex_lock(&refresh_lock);
+    if (length > 0) {
+        memcpy(command->reply, reply, length);
+        command->length = length;
+        command->fetchedAt = monotonic_seconds();
+    }
+    command->pending = false;
+    unsigned int broadcasts = command->broadcasts;
+    command->broadcasts = 0;
+    for (int wi = 0; wi < gateway_waiter_count; ) {
+        if (gateway_waiters[wi].command == command) {
+            waiters[count++] = gateway_waiters[wi];
+            gateway_waiters[wi] = gateway_waiters[--gateway_waiter_count];
+        }
+        else {
+            wi++;
+        }
+    }
+    pthread_mutex_unlock(&refresh_lock);
+    for (int bi = 0; (bi < mqtt_broker_count) && (length > 0); bi++) {
+        if (broadcasts & (1u << bi)) {
+            publish_gateway_reply(&mqtt_brokers[bi], NULL, command, reply, length);
+        }
+    }
+    for (int wi = 0; wi < count; wi++) {
+        if (length > 0) {
+            publish_gateway_reply(waiters[wi].broker, &waiters[wi].request, command, reply, length);
+        }
+        mqtt_request_free(&waiters[wi].request);
+    }
+}
+
+
+#pragma mark - HTTP endpoint
+
+/*
+ * With a port in the [http] section, /live.json (the all_data/json response) and /raw (the last gateway
+ * frame) are served over HTTP/1.1 from the same per-frame caches as the MQTT requests, without any broker
+ * round trip. The ETag is made of a per-start nonce, the frame generation and, for /live.json, when the
+ * cached response was built (values stale by then are left out), so a client sending it back in
+ * If-None-Match gets a 304 without a body until the response changes, and never for one from another run. Connections are kept alive; a single thread serves them with
+ * poll() and closes those idle for HTTP_IDLE_SECONDS.
+ * Responses go to a per-client output buffer that is written out when the socket takes it, never
+ * blocking, so a client that reads slowly only holds up itself. Its next pipelined request waits until
+ * the previous response is out.
+ */
+#define HTTP_MAX_CLIENTS             16
+#define HTTP_REQUEST_MAXLEN          2048
+#define HTTP_IDLE_SECONDS            30
+
+typedef struct {
+    int                     socket;             // -1 for a free slot
+    char                    request[HTTP_REQUEST_MAXLEN + 1];
+    size_t                  length;
+    char                   *output;             // responses not written out yet, kept between them, only grows
+    size_t                  outputLength;
+    size_t                  outputSent;
+    size_t                  outputCapacity;
+    bool                    closing;            // closed once its output is written out
+    double                  lastActive;         // monotonic
+} HttpClient;
+
+int http_listener = -1;
+char http_etag_nonce[32];                       // tells the ETags of one run from those of the others
+pthread_t http_thread_id;
+HttpClient http_clients[HTTP_MAX_CLIENTS];
+atomic_ulong http_requests = 0;
+atomic_ulong http_not_modified = 0;
+
+// Adds to the client's output, written out by http_client_flush
+bool http_send(HttpClient *client, const void *data, size_t length) {
+    if (client->outputLength + length > client->outputCapacity) {
+        size_t capacity = client->outputCapacity ? client->outputCapacity : 4096;
+        while (client->outputLength + length > capacity) {
+            capacity *= 2;
+        }
+        char *grown = realloc(client->output, capacity);
+        if (grown == NULL) {
+            return false;
+        }
+        client->output = grown;
+        client->outputCapacity = capacity;
+    }
+    memcpy(client->output + client->outputLength, data, length);
+    client->outputLength += length;
+    return true;
+}
+
+// Sends a response, without body for HEAD requests and 304s. etag NULL for none
+bool http_respond(HttpClient *client, int status, const char *reason, const char *content_type, const char *etag,
+                  const void *body, size_t length, bool head, bool keep_alive) {
+    char header[256];
+    TextBuilder text = text_builder(header, sizeof(header));
+    text_append(&text, "HTTP/1.1 %d %s\r\n", status, reason);
+    if (etag) {
+        text_append(&text, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+    }
+    if (status != 304) {
+        text_append(&text, "Content-Type: %s\r\nContent-Length: %zu\r\n", content_type, length);
+    }
+    text_append(&text, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    bool with_body = !head && (status != 304) && length;
+    return http_send(client, text.buffer, text.length) && (!with_body || http_send(client, body, length));
+}
+
+void http_respond_error(HttpClient *client, int status, const char *reason, bool head, bool keep_alive) {
+    char body[64];
+    int length = snprintf(body, sizeof(body), "%d %s\n", status, reason);
+    http_respond(client, status, reason, "text/plain", NULL, body, length, head, keep_alive);
+}
+
+// Value of a request header, NULL when it isn't there
+const char *http_header(const char *request, const char *name, char *value, size_t size) {
+    size_t name_length = strlen(name);
+    for (const char *line = strstr(request, "\r\n"); line && (line[2] != '\r'); line = strstr(line + 2, "\r\n")) {
+        const char *field = line + 2;
+        if ((strncasecmp(field, name, name_length) == 0) && (field[name_length] == ':')) {
+            const char *start = field + name_length + 1;
+            start += strspn(start, " \t");
+            snprintf(value, size, "%.*s", (int)strcspn(start, "\r"), start);
+            return value;
+        }
+    }
+    return NULL;
+}
+
+// The quoted ETag of a response: this run, the frame generation and when it was built (0 when it doesn't age)
+const char *http_etag(char *etag, size_t size, unsigned long generation, time_t built) {
+    snprintf(etag, size, "\"%s-%lu-%lld\"", http_etag_nonce, generation, (long long)built);
+    return etag;
+}
+
+// True when If-None-Match holds etag
+bool http_not_modified_since(const char *if_none_match, const char *etag) {
+    return if_none_match && ((strcmp(if_none_match, "*") == 0) || strstr(if_none_match, etag));
+}
+
+// Responding only copies into the client's output, so it's done under the cache lock
+void http_live_json(HttpClient *client, const char *if_none_match, bool head, bool keep_alive) {
+    JsonResponseCache *cache = &json_response_cache;
+    char etag[80];
+    pthread_mutex_lock(&cache->lock);
+    if (!json_response_current(cache)) {
+        http_respond_error(client, 503, "No Recent Data", head, keep_alive);
+    }
+    else if (http_not_modified_since(if_none_match, http_etag(etag, sizeof(etag), cache->generation, cache->builtAt))) {
+        atomic_fetch_add(&http_not_modified, 1);
+        http_respond(client, 304, "Not Modified", NULL, etag, NULL, 0, head, keep_alive);
+    }
+    else if (!http_respond(client, 200, "OK", "application/json", etag, cache->buffer, cache->length, head, keep_alive)) {
+        client->outputLength = client->outputSent; // drops the partial response, the client gets an error instead
+        http_respond_error(client, 500, "Internal Server Error", head, keep_alive);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void http_raw(HttpClient *client, const char *if_none_match, bool head, bool keep_alive) {
+    time_t now;
+    time(&now);
+    char etag[80];
+    RawFrameSlot *slot = raw_frame_acquire();
+    if ((slot == NULL) || ((now - slot->timestamp) > MESSAGE_EXPIRATION_SECONDS)) {
+        http_respond_error(client, 503, "No Recent Data", head, keep_alive);
+    }
+    else if (http_not_modified_since(if_none_match, http_etag(etag, sizeof(etag), slot->generation, 0))) {
+        atomic_fetch_add(&http_not_modified, 1);
+        http_respond(client, 304, "Not Modified", NULL, etag, NULL, 0, head, keep_alive);
+    }
+    else {
+        http_respond(client, 200, "OK", "application/octet-stream", etag, slot->data, slot->length, head, keep_alive);
+    }
+    if (slot) {
+        raw_frame_release(slot);
+    }
+}
+
+// Answers one complete request, returns whether the connection stays open
+bool http_serve(HttpClient *client, const char *request) {
+    char method[8];
+    char path[128];
+    int minor = 0;
+    char connection[32];
+    char if_none_match[128];
+    atomic_fetch_add(&http_requests, 1);
+    if (sscanf(request, "%7s %127s HTTP/1.%d", method, path, &minor) != 3) {
+        http_respond_error(client, 400, "Bad Request", false, false);
+        return false;
+    }
+    bool head = strcmp(method, "HEAD") == 0;
+    const char *connection_header = http_header(request, "Connection", connection, sizeof(connection));
+    bool keep_alive = (minor >= 1) ? !(connection_header && (strcasecmp(connection, "close") == 0))
+                                   : (connection_header && (strcasecmp(connection, "keep-alive") == 0));
+    const char *conditional = http_header(request, "If-None-Match", if_none_match, sizeof(if_none_match));
+    path[strcspn(path, "?")] = 0;
+    if (foreground && verbose) {
+        printf("HTTP %s %s%s\n", method, path, conditional ? " (conditional)" : "");
+    }
+    if (!head && (strcmp(method, "GET") != 0)) {
+        // a request body would have to be skipped
+        http_respond_error(client, 405, "Method Not Allowed", false, false);
+        return false;
+    }
+    if (strcmp(path, "/live.json") == 0) {
+        http_live_json(client, conditional, head, keep_alive);
+    }
+    else if (strcmp(path, "/raw") == 0) {
+        http_raw(client, conditional, head, keep_alive);
+    }
+    else {
+        http_respond_error(client, 404, "Not Found", head, keep_alive);
+    }
+    return keep_alive;
+}
+
+void http_client_close(HttpClient *client) {
+    close(client->socket);
+    client->socket = -1;
+    client->length = 0;
+    client->outputLength = client->outputSent = 0;
+    client->closing = false;
+}
+
+// Writes out as much of the client's output as the socket takes, false when the connection is gone
+bool http_client_flush(HttpClient *client, double now) {
+    while (client->outputSent < client->outputLength) {
+        ssize_t sent = send(client->socket, client->output + client->outputSent, client->outputLength - client->outputSent,
+                            MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                return true; // the rest goes when poll says there's room
+            }
+            http_client_close(client);
+            return false;
+        }
+        client->outputSent += sent;
+        client->lastActive = now;
+    }
+    client->outputLength = client->outputSent = 0;
+    if (client->closing) {
+        http_client_close(client);
+        return false;
+    }
+    return true;
+}
+
+// Answers the complete requests received, pipelined ones in order, each once the previous response is out
+void http_client_serve(HttpClient *client, double now) {
+    while ((client->socket >= 0) && !client->closing && (client->outputLength == 0)) {
+        char *end = strstr(client->request, "\r\n\r\n");
+        if (end == NULL) {
+            if (client->length == HTTP_REQUEST_MAXLEN) {
+                http_respond_error(client, 431, "Request Header Fields Too Large", false, false);
+                client->closing = true;
+                http_client_flush(client, now);
+            }
+            break;
+        }
+        end[2] = 0; // keeps the last header line terminated
+        size_t used = end + 4 - client->request;
+        client->closing = !http_serve(client, client->request);
+        memmove(client->request, client->request + used, client->length - used + 1);
+        client->length -= used;
+        http_client_flush(client, now);
+    }
+}
+
+void http_accept(double now) {
+    int sock = accept(http_listener, NULL, NULL);
+    if (sock < 0) {
+        return;
+    }
+    for (int ci = 0; ci < HTTP_MAX_CLIENTS; ci++) {
+        HttpClient *client = &http_clients[ci];
+        if (client->socket < 0) {
+            client->socket = sock;
+            client->length = 0;
+            client->outputLength = client->outputSent = 0;
+            client->closing = false;
+            client->lastActive = now;
+            return;
+        }
+    }
+    if (foreground && verbose) {
+        printf("Too many HTTP clients, connection refused\n");
+    }
+    close(sock);
+}
+
+// Reads what the client sent and answers the complete requests in it
+void http_client_read(HttpClient *client, double now) {
+    ssize_t received = recv(client->socket, client->request + client->length, HTTP_REQUEST_MAXLEN - client->length, 0);
+    if (received <= 0) {
+        http_client_close(client);
+        return;
+    }
+    client->length += received;
+    client->request[client->length] = 0;
+    client->lastActive = now;
+    http_client_serve(client, now);
+}
+
+void *http_thread(void *arg) {
+    struct pollfd sockets[HTTP_MAX_CLIENTS + 1];
+    while (1) {
+        sockets[0] = (struct pollfd){ .fd = http_listener, .events = POLLIN };
+        for (int ci = 0; ci < HTTP_MAX_CLIENTS; ci++) {
+            // while a response is going out the client's next requests wait in its socket
+            bool writing = http_clients[ci].outputLength > 0;
+            sockets[ci + 1] = (struct pollfd){ .fd = http_clients[ci].socket, .events = writing ? POLLOUT : POLLIN };
+        }
+        if (poll(sockets, HTTP_MAX_CLIENTS + 1, 1000) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                sleep(1);
+            }
+            continue;
+        }
+        double now = monotonic_seconds();
+        for (int ci = 0; ci < HTTP_MAX_CLIENTS; ci++) {
+            HttpClient *client = &http_clients[ci];
+            if (client->socket < 0) {
+                continue;
+            }
+            if ((sockets[ci + 1].revents & POLLOUT) && (client->outputLength > 0)) {
+                if (http_client_flush(client, now)) {
+                    http_client_serve(client, now);
+                }
+            }
+            else if (sockets[ci + 1].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                http_client_close(client);
+            }
+            else if (sockets[ci + 1].revents) {
+                http_client_read(client, now);
+            }
+            else if ((now - client->lastActive) > HTTP_IDLE_SECONDS) {
+                http_client_close(client);
+            }
+        }
+        if (sockets[0].revents & POLLIN) {
+            http_accept(now);
+        }
+    }
+    return NULL;
+}
+
+bool http_start(void) {
+    for (int ci = 0; ci < HTTP_MAX_CLIENTS; ci++) {
+        http_clients[ci].socket = -1;
+    }
+    snprintf(http_etag_nonce, sizeof(http_etag_nonce), "%lx%x", (unsigned long)time(NULL), (unsigned int)getpid());
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(http_port);
+    if (inet_aton(http_address, &addr.sin_addr) == 0) {
+        fprintf(stderr, "Invalid HTTP address %s\n", http_address);
+        return false;
+    }
+    http_listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    setsockopt(http_listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if ((bind(http_listener, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(http_listener, HTTP_MAX_CLIENTS) < 0)) {
+        fprintf(stderr, "Could not listen for HTTP on %s:%d: %s\n", http_address, http_port, strerror(errno));
+        close(http_listener);
+        http_listener = -1;
+        return false;
+    }
+    if (pthread_create(&http_thread_id, NULL, http_thread, NULL) != 0) {
+        fprintf(stderr, "Could not start the HTTP thread\n");
+        close(http_listener);
+        http_listener = -1;
+        return false;
+    }
+    if (foreground) {
+        printf("Serving HTTP on %s:%d\n", http_address, http_port);
+    }
+    return true;
+}
+
+
+#pragma mark -
+
+void publish_stats(MqttBroker *broker, const MqttRequest *request) {
+    unsigned long published = 0;
+    unsigned long suppressed = 0;
+    for (int ti = 0; ti < tag_count(); ti++) {
+        published += atomic_load_explicit(&broker->tagPublish[ti].publishedCount, memory_order_relaxed);
+        suppressed += atomic_load_explicit(&broker->tagPublish[ti].suppressedCount, memory_order_relaxed);
+    }
+    char stats_buffer[1024];
+    TextBuilder stats = text_builder(stats_buffer, sizeof(stats_buffer));
+    text_append(&stats, "{\n\"generation\": %lu,\n\"published\": %lu,\n\"suppressed\": %lu,\n"
+             "\"frame_bytes\": %lu,\n\"frame_bytes_without_aliases\": %lu,\n\"bytes\": %lu,\n\"bytes_without_aliases\": %lu,\n"
+             "\"reconnects\": %lu,\n\"last_outage\": %.1f,\n\"last_recovery\": %.3f,\n"
+             "\"refresh_polls\": %lu,\n\"refresh_coalesced\": %lu,\n"
+             "\"commands\": %lu,\n\"commands_limited\": %lu,\n\"commands_rejected\": %lu,\n\"history_bytes\": %zu,\n"
+             "\"gateway_reads\": %lu,\n\"gateway_cached\": %lu,\n\"http_requests\": %lu,\n\"http_not_modified\": %lu",
+             frame_generation, published, suppressed, broker->frameBytesSent, broker->frameBytesWithoutAliases,
+             atomic_load(&broker->bytesSent), atomic_load(&broker->bytesWithoutAliases),
+             broker->reconnects, broker->lastOutage, broker->lastRecovery,
+             atomic_load(&refresh_polls), atomic_load(&refresh_coalesced),
+             broker->clients.accepted, broker->clients.limited, broker->clients.rejected, history_total_bytes(),
+             atomic_load(&gateway_reads), atomic_load(&gateway_cached), atomic_load(&http_requests), atomic_load(&http_not_modified));
+    if (broker->storeEnabled) {
+        text_append(&stats, ",\n\"stored\": %llu", (unsigned long long)store_ring_count(&broker->store));
+    }
+    pthread_mutex_lock(&broker->scheduler.lock);
+    for (int pc = 0; pc < PRIORITY_COUNT; pc++) {
+        PriorityQueue *queue = &broker->scheduler.classes[pc];
+        text_append(&stats, ",\n\"%s\": { \"sent\": %lu, \"waiting\": %d, \"deferred\": %lu, \"coalesced\": %lu, \"shed\": %lu }",
+                    priority_names[pc], queue->sent, queue->count, queue->deferred, queue->coalesced, queue->shed);
+    }
+    pthread_mutex_unlock(&broker->scheduler.lock);
+    text_append(&stats, "\n}");
+    mqtt_respond(broker, request, TOPIC_ALL_DATA_STATS, stats.buffer, stats.length, &default_publish_options);
+}
+
+
+#pragma mark - Command router
+
+/*
+ * Requests are dispatched through a hash table of commands filled once at startup. A command comes either
+ * from base_topic/cmd/<command>[/<client>] with its arguments as the payload, or from the all_data/request
+ * topic as the first word of the payload. Each command caps the length of its arguments.
+ */
+#define COMMAND_ROUTE_SLOTS          32
+#define COMMAND_MAX_PAYLOAD          256
+
+typedef void (*CommandHandler)(MqttBroker *broker, MqttRequest *request, const char *arguments);
+
+typedef struct {
+    const char             *name;               // NULL for a free slot
+    CommandHandler          handler;
+    int                     maxArguments;       // bytes
+} CommandRoute;
+
+CommandRoute command_routes[COMMAND_ROUTE_SLOTS];
+
+void command_register(const char *name, CommandHandler handler, int max_arguments) {
+    unsigned int index = topic_hash(name) % COMMAND_ROUTE_SLOTS;
+    for (int probe = 0; probe < COMMAND_ROUTE_SLOTS; probe++, index = (index + 1) % COMMAND_ROUTE_SLOTS) {
+        if (command_routes[index].name == NULL) {
+            command_routes[index] = (CommandRoute){ .name = name, .handler = handler, .maxArguments = max_arguments };
+            return;
+        }
+    }
+    fprintf(stderr, "No room to register command %s\n", name);
+}
+
+const CommandRoute *command_route(const char *name) {
+    unsigned int index = topic_hash(name) % COMMAND_ROUTE_SLOTS;
+    for (int probe = 0; probe < COMMAND_ROUTE_SLOTS; probe++, index = (index + 1) % COMMAND_ROUTE_SLOTS) {
+        const CommandRoute *route = &command_routes[index];
+        if (route->name == NULL) {
+            break;
+        }
+        if (strcmp(route->name, name) == 0) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+void command_json(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    if (arguments[0]) {
+        publish_json_filtered(broker, request, arguments);
+    }
+    else {
+        publish_json(broker, request);
+    }
+}
+
+void command_raw(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    publish_raw(broker, request);
+}
+
+void command_stats(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    publish_stats(broker, request);
+}
+
+void command_cbor(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    publish_cbor(broker, request);
+}
+
+void command_refresh(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    refresh_request(broker, request);
+}
+
+void command_resync(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    publish_resync(broker, request);
+}
+
+void command_gateway(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    gateway_request(broker, request, arguments);
+}
+
+void command_history(MqttBroker *broker, MqttRequest *request, const char *arguments) {
+    publish_history(broker, request, arguments);
+}
+
+void command_routes_init(void) {
+    command_register(MSG_ALL_DATA_JSON, command_json, 200);
+    command_register(MSG_ALL_DATA_RAW, command_raw, 0);
+    command_register(MSG_ALL_DATA_STATS, command_stats, 0);
+    command_register(MSG_ALL_DATA_CBOR, command_cbor, 0);
+    command_register(MSG_ALL_DATA_REFRESH, command_refresh, 0);
+    command_register(MSG_ALL_DATA_RESYNC, command_resync, 0);
+    command_register(MSG_GATEWAY, command_gateway, 32);
+    if (history_retention > 0) {
+        command_register(MSG_ALL_DATA_HISTORY, command_history, 160);
+    }
 }
 
-void publish_json(struct mosquitto *mosq) {
-    time_t now;
-    time(&now);
-    char json_buffer[1024];
-    char strbuf[128];
-    bool firstTopic = true;
-    strcpy(json_buffer, "{\n");
-    for (int ti = tag_count() -1; ti >= 0; ti--) {
-        if (tagData[ti].lastMessage[0] && ((now - tagData[ti].lastMessageTimestamp) <= MESSAGE_EXPIRATION_SECONDS)) {
-            if (firstTopic) {
-                firstTopic = false;
-            }
-            else {
-                strcat(json_buffer, ",\n");
-            }
-            sprintf(strbuf, "\"%s\": \"%s\"", tagData[ti].topic, tagData[ti].lastMessage);
-            strcat(json_buffer, strbuf);
-        }
+// Routes a request message, returns false when it isn't one
+bool command_dispatch(MqttBroker *broker, const struct mosquitto_message *message, MqttRequest *request) {
+    char payload[COMMAND_MAX_PAYLOAD + 1];
+    char command[64];
+    const char *client = NULL;
+    const char *arguments;
+    size_t prefix_length = strlen(broker->commandPrefix);
+    bool legacy = strcmp(message->topic, broker->requestTopic) == 0;
+    if (!legacy && (strncmp(message->topic, broker->commandPrefix, prefix_length) != 0)) {
+        return false;
     }
-    strcat(json_buffer, "\n}");
-    if (firstTopic) {
-        fprintf(stderr, "No recent data to publish\n");
+    if ((message->payloadlen < 0) || (message->payloadlen > COMMAND_MAX_PAYLOAD)) {
+        fprintf(stderr, "Request on %s too long (%d bytes, max is %d)\n", message->topic, message->payloadlen, COMMAND_MAX_PAYLOAD);
+        broker->clients.rejected++;
+        return true;
+    }
+    memcpy(payload, message->payload, message->payloadlen);
+    payload[message->payloadlen] = 0;
+    if (foreground) {
+        printf("Message received for %s: %s\n", message->topic, payload);
+    }
+    if (legacy) {
+        // "<command> <arguments>"
+        size_t length = strcspn(payload, " ");
+        snprintf(command, sizeof(command), "%.*s", (int)length, payload);
+        arguments = payload + length + (payload[length] ? 1 : 0);
     }
     else {
-        mqtt_publish(mosq, TOPIC_ALL_DATA_JSON, json_buffer);
+        // cmd/<command>[/<client>]
+        const char *name = message->topic + prefix_length;
+        size_t length = strcspn(name, "/");
+        snprintf(command, sizeof(command), "%.*s", (int)length, name);
+        client = name[length] ? name + length + 1 : NULL;
+        arguments = payload;
+    }
+    const CommandRoute *route = command_route(command);
+    if ((route == NULL) || (strlen(arguments) > (size_t)route->maxArguments)) {
+        fprintf(stderr, "Data type not supported for message %s: %s\n", message->topic, payload);
+        broker->clients.rejected++;
+        return true;
     }
+    if (client == NULL) {
+        client = request->responseTopic ? request->responseTopic : "";
+    }
+    if (!command_client_admit(&broker->clients, &broker->config, client, monotonic_seconds())) {
+        if (foreground && verbose) {
+            printf("Request from %s over its rate, dropped\n", client[0] ? client : "anonymous client");
+        }
+        broker->clients.limited++;
+        return true;
+    }
+    broker->clients.accepted++;
+    route->handler(broker, request, arguments);
+    return true;
 }
 
 
 #pragma mark - MQTT Callbacks
 
 // Callback function for when a connection is established or fails
-void on_connect(struct mosquitto *mosq, void *obj, int rc) {
+void on_connect(struct mosquitto *mosq, void *obj, int rc, int flags) {
+    MqttBroker *broker = obj;
+    MqttBrokerConfig *config = &broker->config;
+    if ((config->protocolVersion == MQTT_PROTOCOL_V5) && ((rc == CONNACK_REFUSED_PROTOCOL_VERSION) || (rc == MQTT_RC_UNSUPPORTED_PROTOCOL_VERSION))) {
+        // the broker doesn't speak MQTT v5, the next reconnect falls back to 3.1.1
+        fprintf(stderr, "Broker %s refused MQTT v5, falling back to 3.1.1\n", config->host);
+        config->protocolVersion = MQTT_PROTOCOL_V311;
+        mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, config->protocolVersion);
+    }
+    atomic_store(&broker->v5Active, (rc == 0) && (config->protocolVersion == MQTT_PROTOCOL_V5));
+    if (rc == 0) {
+        broker->reconnectedAt = monotonic_seconds();
+        if (broker->everConnected && (broker->disconnectedAt > 0)) {
+            broker->lastOutage = broker->reconnectedAt - broker->disconnectedAt;
+            broker->reconnects++;
+            atomic_store(&broker->awaitingFirstPublish, true);
+        }
+        broker->disconnectedAt = 0;
+        broker->everConnected = true;
+        if (!(flags & 1)) {
+            // no session kept by the broker (first connection, or it expired): subscribe again
+            mqtt_subscribe(broker, TOPIC_ALL_DATA_REQUEST);
+            mqtt_subscribe(broker, TOPIC_COMMANDS "#");
+        }
+    }
+    if (rc == 0) {
+        // what was unsent went down with the connection, and so did its topic aliases: none are used until
+        // on_connect_v5 has the new maximum
+        if ((atomic_load(&broker->replayMid) != 0) && !atomic_load(&broker->replayDelivered)) {
+            // a replay handed over but not sent is gone too, it's queued again from the store
+            atomic_store(&broker->replayMid, 0);
+            atomic_store(&broker->replayQueued, false);
+        }
+        atomic_store(&broker->inflight, 0);
+        topic_aliases_reset(&broker->aliases, 0);
+        atomic_store(&broker->tagPublishReset, true);
+    }
+    atomic_store(&broker->connected, rc == 0);
     if (foreground) {
         if (rc == 0) {
-            printf("Connected to MQTT broker successfully.\n");
+            printf("Connected to MQTT broker %s successfully%s.\n", config->host, (flags & 1) ? ", session resumed" : "");
         } else {
-            fprintf(stderr, "Connection failed: %s\n", mosquitto_connack_string(rc));
+            fprintf(stderr, "Connection to %s failed: %s\n", config->host, mosquitto_connack_string(rc));
         }
     }
 }
 
+// MQTT v5 only, called after on_connect with the CONNACK properties
+void on_connect_v5(struct mosquitto *mosq, void *obj, int rc, int flags, const mosquitto_property *properties) {
+    MqttBroker *broker = obj;
+    uint16_t maximum = 0;
+    if (rc == 0) {
+        mosquitto_property_read_int16(properties, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, &maximum, false);
+    }
+    topic_aliases_reset(&broker->aliases, maximum);
+    if (foreground && verbose) {
+        printf("Broker %s allows %d topic aliases\n", broker->config.host, maximum);
+    }
+}
+
 // Callback function for when a connection is established or fails
 void on_disconnect(struct mosquitto *mosq, void *obj, int rc) {
+    MqttBroker *broker = obj;
+    atomic_store(&broker->connected, false);
     if (foreground) {
         if (rc == 0) {
-            printf("Disconnected from MQTT broker successfully.\n");
+            printf("Disconnected from MQTT broker %s successfully.\n", broker->config.host);
         } else {
-            fprintf(stderr, "Disconnection failed: %s\n", mosquitto_connack_string(rc));
+            fprintf(stderr, "Disconnection from %s failed: %s\n", broker->config.host, mosquitto_connack_string(rc));
         }
     }
 }
 
 // Callback function for when a message is published
 void on_publish(struct mosquitto *mosq, void *obj, int mid) {
+    MqttBroker *broker = obj;
+    // sent (qos 0) or acknowledged (qos 1 and 2)
+    int inflight = atomic_load(&broker->inflight);
+    while ((inflight > 0) && !atomic_compare_exchange_weak(&broker->inflight, &inflight, inflight - 1)) {
+    }
+    if ((mid != 0) && (mid == atomic_load(&broker->replayMid))) {
+        atomic_store(&broker->replayDelivered, true);
+    }
     if (foreground) {
         printf("Message published with mid: %d\n", mid);
     }
@@ -380,188 +2656,623 @@ void on_subscribe(struct mosquitto *mosq, void *obj, int mid, int qos_count, con
     }
 }
 
-// Callback function for when a message is received on a subscribed topic
-void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
-    char payload[128];
-    strncpy(payload, message->payload, message->payloadlen);
-    payload[message->payloadlen] = 0;
-    if (foreground) {
-        printf("Message received for %s: %s\n", message->topic, payload);
+// Callback function for when a message is received on a subscribed topic, answered on the same broker.
+// properties are only there with MQTT v5
+void on_message_v5(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message, const mosquitto_property *properties) {
+    MqttBroker *broker = obj;
+    MqttRequest request = { 0 };
+    mosquitto_property_read_string(properties, MQTT_PROP_RESPONSE_TOPIC, &request.responseTopic, false);
+    mosquitto_property_read_binary(properties, MQTT_PROP_CORRELATION_DATA, &request.correlationData, &request.correlationLength, false);
+    if (foreground && verbose && request.responseTopic) {
+        printf("Responding on %s\n", request.responseTopic);
     }
-    char full_topic[128];
-    snprintf(full_topic, sizeof(full_topic), "%s/%s", mqtt_base_topic, TOPIC_ALL_DATA_REQUEST);
-    if (strcmp(message->topic, full_topic) == 0) {
-        if (strcmp(payload, MSG_ALL_DATA_JSON) == 0) {
-            publish_json(mosq);
-        }
-        else if (strcmp(payload, MSG_ALL_DATA_RAW) == 0) {
-            publish_raw(mosq);
+    if (!command_dispatch(broker, message, &request)) {
+        fprintf(stderr, "Missing topic handler for subscribed topic: %s\n", message->topic);
+    }
+    mqtt_request_free(&request);
+}
+
+
+#pragma mark - Parsing
+
+/*
+ * The gateway reply is parsed as a resumable state machine: bytes are fed as they come off the socket,
+ * possibly in several partial segments, and each tag is decoded into a staging snapshot as soon as its
+ * data is complete. tagData is only touched once the trailing checksum has been verified, so a corrupted
+ * or truncated frame never leaves it half updated.
+ */
+
+typedef struct {
+    bool                    present;
+    char                    message[MQTT_MESSAGE_MAXLEN];
+    char                    batteryMessage[MQTT_MESSAGE_MAXLEN];
+    bool                    numeric;
+    TagValue                value;
+} TagStaging;
+
+typedef enum {
+    PARSER_STATE_HEADER,
+    PARSER_STATE_COMMAND,
+    PARSER_STATE_SIZE,
+    PARSER_STATE_TAG,
+    PARSER_STATE_TAG_DATA,
+    PARSER_STATE_SKIP,
+    PARSER_STATE_CHECKSUM,
+    PARSER_STATE_DONE,
+    PARSER_STATE_ERROR,
+} PARSER_STATE;
+
+typedef struct {
+    PARSER_STATE            state;
+    int                     error;
+    int                     fieldBytes;         // bytes read so far of the current multi-byte field
+    unsigned char           command;
+    int                     size;               // declared size, counted from CMD till CHECKSUM
+    int                     sizeBytes;          // width of the size field, it depends on the command
+    int                     dataRemaining;      // data bytes still expected before the checksum
+    unsigned int            checksum;
+    int                     tagIndex;
+    int                     tagLength;
+    int                     tagFill;
+    unsigned char           tagBuffer[TAG_MAX_DATA_LENGTH];
+    TagStaging              staging[TAG_COUNT];
+} FrameParser;
+
+// Decodes the data of one complete tag into its staging slot, false if the data is too short for its type
+bool decode_tag(int ti, FrameCursor cursor, TagStaging *staged) {
+    char* subtopic = tagData[ti].topic;
+    int tagType = tagData[ti].type;
+    int length = tagTypeDataLength(tagType);
+    if (foreground && verbose) {
+        printf("Processing tag 0x%02X index is %d type:%d length = %d subtopic = %s\n", tagData[ti].tag, ti, tagType, length, subtopic);
+    }
+    char *payload = staged->message;
+    size_t payloadSize = sizeof(staged->message);
+    payload[0] = 0;
+    staged->batteryMessage[0] = 0;
+    staged->present = false;
+    staged->numeric = tagTypeIsNumeric(tagType);
+    TagValue value;
+    unsigned int byte;
+    if (staged->numeric) {
+        if (!decode_tag_value(ti, cursor, &value)) return false;
+        staged->value = value;
+        if (value.exponent == 0) {
+            snprintf(payload, payloadSize, "%d", value.value);
         }
         else {
-            fprintf(stderr, "Data type not supported for message %s: %s\n", message->topic, payload);
+            snprintf(payload, payloadSize, "%.1f", value.value / 10.0);
+        }
+        if (value.hasBattery) {
+            snprintf(staged->batteryMessage, sizeof(staged->batteryMessage), "%.2f", value.battery / 100.0);
         }
     }
-    else {
-        fprintf(stderr, "Missing topic handler for subscribed topic: %s\n", message->topic);
+    else if (tagType == TAG_TYPE_16_BYTES_BITMASK) {
+        for (int i = 0; i < 16; i++) {
+            if (!cursor_read_be(&cursor, 1, &byte)) return false;
+            for (int b = 0; b < 8; b++) {
+                payload[(8*i) + (7 - b)] = (byte & (1 << b)) ? '1' : '0';
+            }
+        }
+        payload[128] = 0;
+    }
+    staged->present = (payload[0] != 0);
+    if (!staged->present) {
+        fprintf(stderr, "No payload to publish\n");
+    }
+    return true;
+}
+
+void frame_parser_reset(FrameParser *parser) {
+    parser->state = PARSER_STATE_HEADER;
+    parser->error = RECEIVE_BUFFER_OK;
+    parser->fieldBytes = 0;
+    parser->command = 0;
+    parser->size = 0;
+    parser->dataRemaining = 0;
+    parser->checksum = 0;
+    parser->tagIndex = -1;
+    for (int ti = tag_count() -1; ti >= 0; ti--) {
+        parser->staging[ti].present = false;
     }
 }
 
+void frame_parser_fail(FrameParser *parser, int error) {
+    parser->state = PARSER_STATE_ERROR;
+    parser->error = error;
+}
 
-#pragma mark - Parsing
+// Live data, sensor IDs and broadcast replies have a 2 byte size, the others a single byte
+int command_size_bytes(unsigned char command) {
+    switch (command) {
+        case CMD_GW1000_LIVEDATA:
+        case CMD_READ_SENSOR_ID_NEW:
+        case CMD_BROADCAST:
+            return 2;
+        default:
+            return 1;
+    }
+}
 
-int process_tag(unsigned char *buf, struct mosquitto *mosq) {
-    int ti = tag_index(buf[0]);
-    if (ti >= 0) {
-        char* subtopic = tagData[ti].topic;
-        int tagType = tagData[ti].type;
-        int length = tagTypeDataLength(tagType);
-        if (foreground && verbose) {
-            printf("Processing tag 0x%02X index is %d type:%d length = %d subtopic = %s\n", buf[0], ti, tagType, length, subtopic);
-        }
-        char batttopic[256];
-        char payload[256];
-        payload[0] = 0;
-        int tmpInt;
-        switch (tagType) {
-            case TAG_TYPE_BYTE_LEAVE_ALONE:
-                snprintf(payload, sizeof(payload), "%d", buf[1]);
-                break;
-            case TAG_TYPE_SHORT_LEAVE_ALONE:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                snprintf(payload, sizeof(payload), "%d", tmpInt);
-                break;
-            case TAG_TYPE_3_BYTES_LEAVE_ALONE:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                tmpInt = (tmpInt << 8) + buf[3];
-                snprintf(payload, sizeof(payload), "%d", tmpInt);
-                break;
-            case TAG_TYPE_INT_LEAVE_ALONE:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                tmpInt = (tmpInt << 8) + buf[3];
-                tmpInt = (tmpInt << 8) + buf[4];
-                snprintf(payload, sizeof(payload), "%d", tmpInt);
+// Feeds the next received segment to the parser, returns the state it is left in
+PARSER_STATE frame_parser_feed(FrameParser *parser, FrameCursor segment) {
+    unsigned int byte;
+    while (cursor_read_be(&segment, 1, &byte)) {
+        unsigned char c = byte;
+        switch (parser->state) {
+            case PARSER_STATE_HEADER:
+                if (c != 0xFF) {
+                    frame_parser_fail(parser, INVALID_HEADER);
+                }
+                else if (++parser->fieldBytes == 2) {
+                    parser->state = PARSER_STATE_COMMAND;
+                }
                 break;
-            case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                snprintf(payload, sizeof(payload), "%.1f", tmpInt / 10.0);
+            case PARSER_STATE_COMMAND:
+                parser->command = c;
+                parser->sizeBytes = command_size_bytes(c);
+                parser->checksum += c;
+                parser->fieldBytes = 0;
+                parser->state = PARSER_STATE_SIZE;
                 break;
-            case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                if (buf[1] & 0x80) { // if highest bit of short is set it's a negative number
-                    tmpInt = tmpInt - 0xFFFF;
+            case PARSER_STATE_SIZE:
+                parser->size = (parser->size << 8) + c;
+                parser->checksum += c;
+                if (++parser->fieldBytes == parser->sizeBytes) {
+                    parser->dataRemaining = parser->size - 2 - parser->sizeBytes; // cmd, size bytes and checksum
+                    if (parser->dataRemaining < 0) {
+                        frame_parser_fail(parser, INVALID_LENGTH);
+                    }
+                    else if (parser->dataRemaining == 0) {
+                        parser->state = PARSER_STATE_CHECKSUM;
+                    }
+                    else {
+                        parser->state = (parser->command == CMD_GW1000_LIVEDATA) ? PARSER_STATE_TAG : PARSER_STATE_SKIP;
+                    }
                 }
-                snprintf(payload, sizeof(payload), "%.1f", tmpInt / 10.0);
                 break;
-            case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
-                tmpInt = buf[1];
-                tmpInt = (tmpInt << 8) + buf[2];
-                if (buf[1] & 0x80) { // if highest bit of short is set it's a negative number
-                    tmpInt = tmpInt - 0xFFFF;
+            case PARSER_STATE_TAG:
+                parser->checksum += c;
+                parser->dataRemaining--;
+                parser->tagIndex = tag_index(c);
+                parser->tagLength = (parser->tagIndex >= 0) ? tagTypeDataLength(tagData[parser->tagIndex].type) : 0;
+                if (parser->tagLength == 0) {
+                    // unknown tag or variable length record, there is no way to find the next tag
+                    if (foreground && verbose) {
+                        printf("Can't process tag 0x%02X, skipping the rest of the frame\n", c);
+                    }
+                    parser->state = parser->dataRemaining ? PARSER_STATE_SKIP : PARSER_STATE_CHECKSUM;
+                }
+                else if (parser->tagLength > parser->dataRemaining) {
+                    frame_parser_fail(parser, INVALID_LENGTH);
+                }
+                else {
+                    parser->tagFill = 0;
+                    parser->state = PARSER_STATE_TAG_DATA;
                 }
-                char* sensor = strrchr(subtopic, '/');
-                strcpy(batttopic, "battery");
-                strcat(batttopic, sensor);
-                snprintf(payload, sizeof(payload), "%.2f", buf[3] * 0.02);
-                mqtt_publish(mosq, batttopic, payload);
-                
-                snprintf(payload, sizeof(payload), "%.1f", tmpInt / 10.0);
-                break;
-            case TAG_TYPE_3_BYTES_TIME:
-                payload[0] = 0;
-                break;
-            case TAG_TYPE_6_BYTES_TIME:
-                payload[0] = 0;
                 break;
-            case TAG_TYPE_16_BYTES_BITMASK:
-                for (int i = 0; i < 16; i++) {
-                    for (int b = 0; b < 8; b++) {
-                        payload[(8*i) + (7 - b)] = (buf[1 + i] & (1 << b)) ? '1' : '0';
+            case PARSER_STATE_TAG_DATA:
+                parser->checksum += c;
+                parser->dataRemaining--;
+                parser->tagBuffer[parser->tagFill++] = c;
+                if (parser->tagFill == parser->tagLength) {
+                    if (!decode_tag(parser->tagIndex, cursor_make(parser->tagBuffer, parser->tagLength), &parser->staging[parser->tagIndex])) {
+                        frame_parser_fail(parser, INVALID_LENGTH);
+                    }
+                    else {
+                        parser->state = parser->dataRemaining ? PARSER_STATE_TAG : PARSER_STATE_CHECKSUM;
                     }
                 }
-                payload[128] = 0;
                 break;
-            case TAG_TYPE_16_BYTES_CO2:
-            case TAG_TYPE_20_BYTES_PIEZO_GAIN:
-                payload[0] = 0;
+            case PARSER_STATE_SKIP:
+                parser->checksum += c;
+                if (--parser->dataRemaining == 0) {
+                    parser->state = PARSER_STATE_CHECKSUM;
+                }
                 break;
-            case TAG_TYPE_PM25_AQI:
-                payload[0] = 0;
-                return -1;
+            case PARSER_STATE_CHECKSUM:
+                if ((parser->checksum % 256) != c) {
+                    frame_parser_fail(parser, INVALID_CHECKSUM);
+                }
+                else {
+                    parser->state = PARSER_STATE_DONE;
+                }
                 break;
+            case PARSER_STATE_DONE:
+            case PARSER_STATE_ERROR:
+                return parser->state;
+        }
+    }
+    return parser->state;
+}
+
+void tag_battery_topic(int ti, char *topic, size_t size) {
+    const char *sensor = strrchr(tagData[ti].topic, '/');
+    snprintf(topic, size, "battery%s", sensor ? sensor : "/");
+}
+
+// The snapshot in CBOR: {"seq": n, "ts": t, "values": {topic: value}}, same keys as the JSON one
+void build_snapshot_cbor(FrameParser *parser, unsigned long generation, time_t timestamp, CborWriter *cbor) {
+    cbor_put_map(cbor, 3);
+    cbor_put_text(cbor, "seq");
+    cbor_put_uint(cbor, generation);
+    cbor_put_text(cbor, "ts");
+    cbor_put_int(cbor, timestamp);
+    cbor_put_text(cbor, "values");
+    cbor_put_map_begin(cbor);
+    char batttopic[256];
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagStaging *staged = &parser->staging[ti];
+        if (!staged->present) {
+            continue;
         }
-        if (payload[0]) {
-            mqtt_publish(mosq, subtopic, payload);
-            strncpy(tagData[ti].lastMessage, payload, MQTT_MESSAGE_MAXLEN);
-            time(&tagData[ti].lastMessageTimestamp);
+        cbor_put_text(cbor, tagData[ti].topic);
+        if (staged->numeric) {
+            cbor_put_tag_value(cbor, &staged->value);
         }
         else {
-            fprintf(stderr, "No payload to publish\n");
+            cbor_put_text(cbor, staged->message);
+        }
+        if (staged->batteryMessage[0]) {
+            tag_battery_topic(ti, batttopic, sizeof(batttopic));
+            cbor_put_text(cbor, batttopic);
+            cbor_put_tag_battery(cbor, &staged->value);
         }
-        return 1 + length;
     }
-    else {
-        return -1;
+    cbor_put_end(cbor);
+}
+
+// One compact message with every value of the frame, in the configured format. In JSON numbers are
+// unquoted, other values are strings. Built in a buffer owned by this function, false when it can't be built.
+bool build_snapshot(FrameParser *parser, unsigned long generation, time_t timestamp, const void **payload, size_t *length) {
+    static char *snapshot_buffer = NULL;
+    static size_t snapshot_buffer_size = 0;
+    if (snapshot_buffer == NULL) {
+        snapshot_buffer_size = snapshot_capacity();
+        snapshot_buffer = malloc(snapshot_buffer_size);
+        if (snapshot_buffer == NULL) {
+            fprintf(stderr, "Could not allocate the snapshot buffer\n");
+            return false;
+        }
+    }
+    if (payload_format == PAYLOAD_CBOR) {
+        CborWriter cbor = cbor_writer((uint8_t *)snapshot_buffer, snapshot_buffer_size);
+        build_snapshot_cbor(parser, generation, timestamp, &cbor);
+        if (cbor.overflow) {
+            fprintf(stderr, "Snapshot doesn't fit in %zu bytes\n", snapshot_buffer_size);
+            return false;
+        }
+        *payload = cbor.buffer;
+        *length = cbor.length;
+        return true;
+    }
+    TextBuilder json = text_builder(snapshot_buffer, snapshot_buffer_size);
+    text_append(&json, "{\"seq\":%lu,\"ts\":%ld,\"values\":{", generation, (long)timestamp);
+    bool first = true;
+    char batttopic[256];
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagStaging *staged = &parser->staging[ti];
+        if (!staged->present) {
+            continue;
+        }
+        const char *quote = staged->numeric ? "" : "\"";
+        text_append(&json, "%s\"%s\":%s%s%s", first ? "" : ",", tagData[ti].topic, quote, staged->message, quote);
+        first = false;
+        if (staged->batteryMessage[0]) {
+            tag_battery_topic(ti, batttopic, sizeof(batttopic));
+            text_append(&json, ",\"%s\":%s", batttopic, staged->batteryMessage);
+        }
     }
+    text_append(&json, "}}");
+    if (json.overflow) {
+        fprintf(stderr, "Snapshot doesn't fit in %zu bytes\n", snapshot_buffer_size);
+        return false;
+    }
+    *payload = json.buffer;
+    *length = json.length;
+    return true;
 }
 
-void parse_and_publish(unsigned char *buf, struct mosquitto *mosq) {
-    if (foreground && verbose) printf("Parse and publish buffer starts\n");
-    // skip 0xFFFF header
-    buf += 2;
-    int readBytes = 0;
-    // skip command
-    buf++; readBytes++;
-    // skip length
-    int length = buf[0];
-    length = (length << 8) + buf[1];
-    buf += 2;
-    readBytes += 2;
-    
-    data_buffer_len = length;
-    memcpy(data_buffer, buf, data_buffer_len);
-    time(&data_buffer_last_update);
-    
-    while (readBytes < length) {
-        int tagChunkSize = process_tag(buf, mosq);
-        if (tagChunkSize > 0) {
-            readBytes += tagChunkSize;
-            buf += tagChunkSize;
+void publish_snapshot(const void *payload, size_t length) {
+    PublishOptions options = snapshot_publish_options();
+    publish_frame_message(PRIORITY_NORMAL, TOPIC_SNAPSHOT, payload, length, &options);
+}
+
+// The tags of the frame that differ from the tag state, before it's updated, and those the last frame had
+// and this one lacks. Published even when nothing changed, so seq and prev stay continuous
+void publish_delta(FrameParser *parser, unsigned long generation, time_t timestamp) {
+    static void *delta_buffer = NULL;
+    static size_t delta_buffer_size = 0;
+    if (delta_buffer == NULL) {
+        delta_buffer_size = snapshot_capacity();
+        delta_buffer = malloc(delta_buffer_size);
+        if (delta_buffer == NULL) {
+            fprintf(stderr, "Could not allocate the delta buffer\n");
+            return;
         }
-        else {
-            break;
+    }
+    StateWriter writer = state_writer(delta_buffer, delta_buffer_size);
+    state_writer_begin(&writer, generation, &delta_previous, timestamp);
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagStaging *staged = &parser->staging[ti];
+        TagState *state = &tag_state.tags[ti];
+        bool in_last_frame = state->lastMessage[0] && (state->lastGeneration == tag_state.generation);
+        if (staged->present && (!in_last_frame || (strcmp(staged->message, state->lastMessage) != 0))) {
+            state_writer_value(&writer, ti, staged->message, staged->numeric, &staged->value);
+        }
+        else if (!staged->present && in_last_frame) {
+            state_writer_removed(&writer, ti);
+        }
+    }
+    const void *payload;
+    size_t length;
+    if (!state_writer_end(&writer, &payload, &length)) {
+        fprintf(stderr, "Delta doesn't fit in %zu bytes\n", delta_buffer_size);
+        return;
+    }
+    PublishOptions options = snapshot_publish_options();
+    options.sequenced = true;
+    publish_frame_message(PRIORITY_NORMAL, TOPIC_DELTA, payload, length, &options);
+}
+
+// Per-tag message in the configured format, battery selects the battery voltage of the tag
+bool publish_tag_message(MqttBroker *broker, int ti, const char *topic, TagStaging *staged, bool battery) {
+    PublishOptions options = tag_publish_options(ti);
+    PRIORITY_CLASS priority = tag_publish_config[ti].priority;
+    if (payload_format == PAYLOAD_TEXT) {
+        const char *message = battery ? staged->batteryMessage : staged->message;
+        return publish_scheduler_enqueue(&broker->scheduler, priority, topic, message, strlen(message), &options);
+    }
+    uint8_t buffer[MQTT_MESSAGE_MAXLEN + 8];
+    CborWriter cbor = cbor_writer(buffer, sizeof(buffer));
+    if (battery) {
+        cbor_put_tag_battery(&cbor, &staged->value);
+    }
+    else if (staged->numeric) {
+        cbor_put_tag_value(&cbor, &staged->value);
+    }
+    else {
+        cbor_put_text(&cbor, staged->message);
+    }
+    options.contentType = CONTENT_TYPE_CBOR;
+    return publish_scheduler_enqueue(&broker->scheduler, priority, topic, cbor.buffer, cbor.length, &options);
+}
+
+// Broker unreachable: keep the frame snapshot in its store instead of publishing it
+void store_frame(MqttBroker *broker, unsigned long generation, time_t timestamp, const void *payload, size_t length) {
+    uint64_t dropped = store_ring_dropped(&broker->store);
+    store_ring_append(&broker->store, generation, timestamp, payload, length);
+    if (store_ring_dropped(&broker->store) != dropped) {
+        fprintf(stderr, "Store of %s full, dropped %llu oldest snapshots\n", broker->config.host,
+                (unsigned long long)(store_ring_dropped(&broker->store) - dropped));
+    }
+    if (foreground && verbose) {
+        printf("Broker %s unreachable, frame %lu stored, %llu waiting\n", broker->config.host, generation,
+               (unsigned long long)store_ring_count(&broker->store));
+    }
+}
+
+#pragma mark - Aggregates
+
+/*
+ * Tags with aggregate windows in their [tag <pattern>] section get the min, max and mean of their value
+ * over each window. Windows are aligned on multiples of their length since the epoch (UTC) and don't
+ * overlap, so a running min, max, sum and count per window is all it takes: O(1) per frame whatever the
+ * number of polls. When a window closes, its aggregate is published on <topic>/aggregate/<seconds> with
+ * the tag's delivery options and priority, and the next one starts from scratch.
+ */
+typedef struct {
+    int64_t                 period;             // index of the window being filled, 0 before the first sample
+    uint64_t                count;
+    int32_t                 minimum;
+    int32_t                 maximum;
+    int64_t                 sum;
+} TagAggregate;
+
+TagAggregate tag_aggregates[TAG_COUNT][AGGREGATE_MAX_WINDOWS];
+
+void tag_aggregates_init(void) {
+    for (int ti = 0; ti < tag_count(); ti++) {
+        if (!tagTypeIsNumeric(tagData[ti].type)) {
+            tag_publish_config[ti].aggregateCount = 0;
         }
     }
 }
 
-int check_receive_buffer(unsigned char* receive_buffer) {
-    if ((receive_buffer[0] != 0xFF)||(receive_buffer[1] != 0xFF))
-        return INVALID_HEADER;
-    int length = receive_buffer[3];
-    length = (length << 8) + receive_buffer[4];
-    int checksum = 0;
-    for (int i = 2; i <= length; i++) {
-        checksum += receive_buffer[i];
+void publish_aggregate(int ti, int span, const TagAggregate *aggregate) {
+    int64_t start = aggregate->period * span;
+    double mean = (double)aggregate->sum / aggregate->count;
+    char topic[256];
+    snprintf(topic, sizeof(topic), "%s/aggregate/%d", tagData[ti].topic, span);
+    PublishOptions options = tag_publish_options(ti);
+    if ((options.expiry > 0) && (options.expiry < span)) {
+        options.expiry = span; // good until the next one
+    }
+    int exponent = tagTypeExponent(tagData[ti].type);
+    if (payload_format == PAYLOAD_CBOR) {
+        uint8_t buffer[128];
+        CborWriter cbor = cbor_writer(buffer, sizeof(buffer));
+        cbor_put_map(&cbor, 6);
+        cbor_put_text(&cbor, "start");
+        cbor_put_int(&cbor, start);
+        cbor_put_text(&cbor, "end");
+        cbor_put_int(&cbor, start + span);
+        cbor_put_text(&cbor, "count");
+        cbor_put_uint(&cbor, aggregate->count);
+        cbor_put_text(&cbor, "min");
+        cbor_put_decimal(&cbor, aggregate->minimum, exponent);
+        cbor_put_text(&cbor, "max");
+        cbor_put_decimal(&cbor, aggregate->maximum, exponent);
+        cbor_put_text(&cbor, "mean");
+        cbor_put_decimal(&cbor, llround(mean * 10), exponent - 1); // one more digit than the samples
+        options.contentType = CONTENT_TYPE_CBOR;
+        publish_frame_message(tag_publish_config[ti].priority, topic, cbor.buffer, cbor.length, &options);
+        return;
+    }
+    TagValue minimum = { .value = aggregate->minimum, .exponent = exponent };
+    TagValue maximum = { .value = aggregate->maximum, .exponent = exponent };
+    int precision = (exponent < 0) ? -exponent : 0;
+    char message[256];
+    snprintf(message, sizeof(message), "{\"start\":%lld,\"end\":%lld,\"count\":%llu,\"min\":%.*f,\"max\":%.*f,\"mean\":%.*f}",
+             (long long)start, (long long)(start + span), (unsigned long long)aggregate->count,
+             precision, tag_value_as_double(&minimum), precision, tag_value_as_double(&maximum),
+             precision + 1, mean * pow(10, exponent));
+    publish_frame_message(tag_publish_config[ti].priority, topic, message, strlen(message), &options);
+}
+
+// Adds the numeric values of a committed frame to their windows, publishing the windows it closes
+void tag_aggregates_update(FrameParser *parser, time_t timestamp) {
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagPublishConfig *config = &tag_publish_config[ti];
+        TagStaging *staged = &parser->staging[ti];
+        if (!staged->present || !staged->numeric) {
+            continue;
+        }
+        for (int wi = 0; wi < config->aggregateCount; wi++) {
+            TagAggregate *aggregate = &tag_aggregates[ti][wi];
+            int span = config->aggregateSpans[wi];
+            int64_t period = timestamp / span;
+            int32_t value = staged->value.value;
+            if (period != aggregate->period) {
+                if (aggregate->count) {
+                    publish_aggregate(ti, span, aggregate);
+                }
+                *aggregate = (TagAggregate){ .period = period, .minimum = value, .maximum = value };
+            }
+            aggregate->count++;
+            aggregate->sum += value;
+            if (value < aggregate->minimum) {
+                aggregate->minimum = value;
+            }
+            if (value > aggregate->maximum) {
+                aggregate->maximum = value;
+            }
+        }
     }
-    checksum = checksum % 256;
-    if (checksum != receive_buffer[length + 1])
-        return INVALID_CHECKSUM;
-    return RECEIVE_BUFFER_OK;
 }
 
 
 #pragma mark -
 
+// Adds the numeric values of a committed frame to their history, and forgets what's past the retention
+void history_record(FrameParser *parser, time_t timestamp) {
+    pthread_rwlock_wrlock(&history_lock);
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagStaging *staged = &parser->staging[ti];
+        if (staged->present && staged->numeric) {
+            if (!history_append(&history_series[ti], timestamp, staged->value.value)) {
+                fprintf(stderr, "Could not extend the history of %s\n", tagData[ti].topic);
+            }
+            history_trim(&history_series[ti], timestamp - history_retention);
+        }
+    }
+    pthread_rwlock_unlock(&history_lock);
+}
+
+// Publishes the verified staging snapshot to every broker and makes it the current tag state
+void frame_parser_commit(FrameParser *parser, unsigned long generation) {
+    time_t now;
+    time(&now);
+    unsigned long bytes_sent[MQTT_MAX_BROKERS];
+    unsigned long bytes_without_aliases[MQTT_MAX_BROKERS];
+    bool any_online = false;
+    bool any_storing = false;
+    for (int bi = 0; bi < mqtt_broker_count; bi++) {
+        MqttBroker *broker = &mqtt_brokers[bi];
+        bytes_sent[bi] = atomic_load(&broker->bytesSent);
+        bytes_without_aliases[bi] = atomic_load(&broker->bytesWithoutAliases);
+        bool online = atomic_load(&broker->connected);
+        any_online |= online;
+        any_storing |= !online && broker->storeEnabled;
+        if (!online && !broker->storeEnabled && foreground && verbose) {
+            printf("Broker %s unreachable, frame %lu not published\n", broker->config.host, generation);
+        }
+    }
+    // the snapshot is built once, for the connected brokers and the stores of the others
+    const void *snapshot = NULL;
+    size_t snapshot_length = 0;
+    if ((any_storing || (any_online && (snapshot_mode != SNAPSHOT_OFF))) && !build_snapshot(parser, generation, now, &snapshot, &snapshot_length)) {
+        snapshot = NULL;
+    }
+    for (int bi = 0; (bi < mqtt_broker_count) && snapshot; bi++) {
+        MqttBroker *broker = &mqtt_brokers[bi];
+        if (!atomic_load(&broker->connected) && broker->storeEnabled) {
+            store_frame(broker, generation, now, snapshot, snapshot_length);
+        }
+    }
+    for (int bi = 0; (bi < mqtt_broker_count) && (snapshot_mode != SNAPSHOT_ONLY); bi++) {
+        MqttBroker *broker = &mqtt_brokers[bi];
+        if (!atomic_load(&broker->connected)) {
+            continue;
+        }
+        if (atomic_exchange(&broker->tagPublishReset, false) | atomic_exchange(&broker->scheduler.shed, false)) {
+            for (int ti = 0; ti < tag_count(); ti++) {
+                broker->tagPublish[ti].published = false;
+            }
+        }
+        for (int ti = 0; ti < tag_count(); ti++) {
+            TagStaging *staged = &parser->staging[ti];
+            const TagValue *value = staged->numeric ? &staged->value : NULL;
+            if (!staged->present || !tag_should_publish(&broker->tagPublish[ti], ti, staged->message, value, now)) {
+                continue;
+            }
+            bool queued = true;
+            if (staged->batteryMessage[0]) {
+                char batttopic[256];
+                tag_battery_topic(ti, batttopic, sizeof(batttopic));
+                queued = publish_tag_message(broker, ti, batttopic, staged, true);
+            }
+            if (publish_tag_message(broker, ti, tagData[ti].topic, staged, false) && queued) {
+                tag_publish_record(&broker->tagPublish[ti], staged->message, value, now);
+            }
+        }
+    }
+    if ((snapshot_mode != SNAPSHOT_OFF) && any_online && snapshot) {
+        publish_snapshot(snapshot, snapshot_length);
+    }
+    if (delta_enabled && any_online) {
+        publish_delta(parser, generation, now);
+    }
+    delta_previous = generation;
+    tag_aggregates_update(parser, now);
+    for (int bi = 0; bi < mqtt_broker_count; bi++) {
+        MqttBroker *broker = &mqtt_brokers[bi];
+        publish_scheduler_drain(broker);
+        broker->frameBytesSent = atomic_load(&broker->bytesSent) - bytes_sent[bi];
+        broker->frameBytesWithoutAliases = atomic_load(&broker->bytesWithoutAliases) - bytes_without_aliases[bi];
+        if (foreground && verbose && atomic_load(&broker->connected)) {
+            printf("Frame %lu published to %s in %lu bytes, %lu without topic aliases\n", generation, broker->config.host,
+                   broker->frameBytesSent, broker->frameBytesWithoutAliases);
+        }
+    }
+    tag_state_write_begin();
+    tag_state.generation = generation;
+    tag_state.timestamp = now;
+    for (int ti = 0; ti < tag_count(); ti++) {
+        TagStaging *staged = &parser->staging[ti];
+        if (staged->present) {
+            strcpy(tag_state.tags[ti].lastMessage, staged->message);
+            tag_state.tags[ti].lastMessageTimestamp = now;
+            tag_state.tags[ti].lastGeneration = generation;
+            tag_state.tags[ti].numeric = staged->numeric;
+            tag_state.tags[ti].value = staged->value;
+        }
+    }
+    tag_state_write_end();
+    if (history_retention > 0) {
+        history_record(parser, now);
+    }
+}
+
+
+#pragma mark - Gateway
+
 int prepare_command_buffer(unsigned char* command_buffer, unsigned char cmd, unsigned char* payload, unsigned int length) {
     if (length >= (0xFF - 3)) {
         fprintf(stderr, "Attempting to write a payload longer than allowed (%d, max is %d\n", length, 0xFF - 3);
         return -1;
     }
-    if ((length > 0) && (payload != NULL)) {
+    if ((length > 0) && (payload == NULL)) {
         fprintf(stderr, "Attempting to write a payload length %d but payload pointer is null\n", length);
         return -1;
     }
@@ -580,82 +3291,280 @@ int prepare_command_buffer(unsigned char* command_buffer, unsigned char cmd, uns
     return 5 + length;
 }
 
+// Opens a connection to the gateway, -1 when it can't be reached
+int gateway_connect(void) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(weather_port);
+    inet_aton(weather_host, &addr.sin_addr);
+    
+    struct timeval timeout = { .tv_sec = GATEWAY_TIMEOUT_SECONDS, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (foreground) perror("connect"); else syslog(LOG_ERR, "connect failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Sends a command frame and feeds the reply to the parser segment by segment as it comes in, the reply
+// is left in receive_buffer. Returns the number of bytes received
+ssize_t gateway_exchange(int sock, const unsigned char *command, int length, FrameParser *parser, unsigned char *receive_buffer) {
+    send(sock, command, length, 0);
+    frame_parser_reset(parser);
+    ssize_t n = 0;
+    while ((parser->state != PARSER_STATE_DONE) && (parser->state != PARSER_STATE_ERROR)) {
+        if (n >= RECEIVE_BUFFER_SIZE) {
+            frame_parser_fail(parser, INVALID_LENGTH);
+            break;
+        }
+        ssize_t segment = recv(sock, receive_buffer + n, RECEIVE_BUFFER_SIZE - n, 0);
+        if (segment <= 0) {
+            break;
+        }
+        frame_parser_feed(parser, cursor_make(receive_buffer + n, segment));
+        n += segment;
+    }
+    return n;
+}
+
+// Runs the gateway reads requested since the last call, one connection at a time like the polls
+void gateway_run_pending(void) {
+    static FrameParser parser;
+    static unsigned char reply[RECEIVE_BUFFER_SIZE];
+    GatewayCommand *pending[GATEWAY_COMMAND_COUNT];
+    int count = 0;
+    pthread_mutex_lock(&refresh_lock);
+    for (int ci = 0; gateway_requested && (ci < GATEWAY_COMMAND_COUNT); ci++) {
+        if (gateway_commands[ci].pending) {
+            pending[count++] = &gateway_commands[ci];
+        }
+    }
+    gateway_requested = false;
+    pthread_mutex_unlock(&refresh_lock);
+    for (int ci = 0; ci < count; ci++) {
+        unsigned char command_buffer[8];
+        int command_length = prepare_command_buffer(command_buffer, pending[ci]->command, NULL, 0);
+        int length = 0;
+        int sock = gateway_connect();
+        if (sock >= 0) {
+            gateway_exchange(sock, command_buffer, command_length, &parser, reply);
+            close(sock);
+            atomic_fetch_add(&gateway_reads, 1);
+            if ((parser.state == PARSER_STATE_DONE) && (parser.command == pending[ci]->command)) {
+                length = parser.size + 2; // size excludes the 2 byte header
+            }
+        }
+        if (foreground && verbose) {
+            printf("Gateway read %s: %d bytes\n", pending[ci]->name, length);
+        }
+        if (length == 0) {
+            fprintf(stderr, "Gateway read %s failed\n", pending[ci]->name);
+        }
+        gateway_complete(pending[ci], reply, length);
+    }
+}
+
+
+#pragma mark - Replay
+
+/*
+ * Stored snapshots are replayed on the snapshot topic with their original seq and ts, one at a time. The
+ * oldest goes through the scheduler as a low priority sequenced message, so the class rate and the
+ * in-flight limit apply to it, and stays in the store until libmosquitto reports it sent (matched by its
+ * mid, or once nothing handed over is left unsent). One lost with the connection is queued again from
+ * the store after the reconnect, so a crash or an outage can repeat a snapshot but never lose one.
+ */
+
+// True once the replay on its way was sent
+bool store_replay_delivered(MqttBroker *broker) {
+    if (atomic_load(&broker->replayDelivered)) {
+        return true;
+    }
+    // its callback may have run before the mid was known
+    return (atomic_load(&broker->replayMid) != 0) && (atomic_load(&broker->inflight) == 0);
+}
+
+// Moves the replay on, true while there is one on its way
+bool store_replay_one(MqttBroker *broker) {
+    StoreRecord record;
+    if (atomic_load(&broker->replayQueued)) {
+        if (!store_replay_delivered(broker)) {
+            return true;
+        }
+        // the store may have dropped it to make room while the broker was away
+        if (store_ring_peek(&broker->store, &record) && (record.sequence == broker->replaySequence)) {
+            store_ring_pop(&broker->store);
+            if (foreground && verbose) {
+                printf("Replayed frame %llu from %lld to %s, %llu left\n", (unsigned long long)record.sequence,
+                       (long long)record.timestamp, broker->config.host, (unsigned long long)store_ring_count(&broker->store));
+            }
+        }
+        atomic_store(&broker->replayMid, 0);
+        atomic_store(&broker->replayDelivered, false);
+        atomic_store(&broker->replayQueued, false);
+    }
+    if (!store_ring_peek(&broker->store, &record)) {
+        return false;
+    }
+    PublishOptions options = snapshot_publish_options();
+    options.sequenced = true;
+    options.replay = true;
+    broker->replaySequence = record.sequence;
+    atomic_store(&broker->replayMid, 0);
+    atomic_store(&broker->replayDelivered, false);
+    atomic_store(&broker->replayQueued, true);
+    if (!publish_scheduler_enqueue(&broker->scheduler, PRIORITY_LOW, TOPIC_SNAPSHOT, record.payload, record.length, &options)) {
+        atomic_store(&broker->replayQueued, false);
+        return false; // stays in the store for the next attempt
+    }
+    publish_scheduler_drain(broker);
+    return true;
+}
+
+// Waits until the next poll, draining each store at the replay rate while its broker is reachable and
+// running the gateway reads asked for. A refresh request ends the wait early
+void poll_wait(int seconds) {
+    double deadline = monotonic_seconds() + seconds;
+    double replay_interval = 1.0 / ((store_replay_rate > 0) ? store_replay_rate : 1);
+    while (1) {
+        gateway_run_pending();
+        double remaining = deadline - monotonic_seconds();
+        if (remaining <= 0) {
+            break;
+        }
+        double pause = (remaining < 1.0) ? remaining : 1.0;
+        for (int bi = 0; bi < mqtt_broker_count; bi++) {
+            MqttBroker *broker = &mqtt_brokers[bi];
+            if (broker->storeEnabled && atomic_load(&broker->connected) && store_replay_one(broker)) {
+                pause = (remaining < replay_interval) ? remaining : replay_interval;
+            }
+        }
+        if (refresh_wait(pause)) {
+            break;
+        }
+    }
+}
 
 
 #pragma mark -
 
+// Sets up a configured broker: its queue, its store and its mosquitto instance, then starts its thread
+bool broker_start(MqttBroker *broker, const MqttBrokerConfig *config) {
+    broker->config = *config;
+    snprintf(broker->requestTopic, sizeof(broker->requestTopic), "%s/%s", config->baseTopic, TOPIC_ALL_DATA_REQUEST);
+    snprintf(broker->commandPrefix, sizeof(broker->commandPrefix), "%s/%s", config->baseTopic, TOPIC_COMMANDS);
+    pthread_mutex_init(&broker->aliases.lock, NULL);
+    if (!publish_scheduler_init(&broker->scheduler)) {
+        return false;
+    }
+    broker->store.fd = -1;
+    if (store_path[0]) {
+        // the default broker uses the store path as is, named ones get their own file next to it
+        char path[sizeof(store_path) + sizeof(config->name) + 1];
+        snprintf(path, sizeof(path), config->name[0] ? "%s.%s" : "%s%s", store_path, config->name);
+        broker->storeEnabled = (store_ring_open(&broker->store, path, store_size) == 0);
+        if (!broker->storeEnabled) {
+            fprintf(stderr, "Could not open the store %s, frames are lost while %s is down\n", path, config->host);
+        }
+    }
+    if (foreground) {
+        printf("MQTT host:%s port %d\n", config->host, config->port);
+    }
+    // no clean session: the broker keeps the subscription (and qos 1 messages) across reconnects
+    broker->mosq = mosquitto_new(config->clientid, false, broker);
+    if (broker->mosq == NULL) {
+        fprintf(stderr, "Could not create mosquitto object for %s\n", config->host);
+        return false;
+    }
+    mosquitto_int_option(broker->mosq, MOSQ_OPT_PROTOCOL_VERSION, config->protocolVersion);
+    mosquitto_threaded_set(broker->mosq, true);
+    mosquitto_connect_with_flags_callback_set(broker->mosq, on_connect);
+    mosquitto_connect_v5_callback_set(broker->mosq, on_connect_v5);
+    mosquitto_disconnect_callback_set(broker->mosq, on_disconnect);
+    mosquitto_publish_callback_set(broker->mosq, on_publish);
+    mosquitto_subscribe_callback_set(broker->mosq, on_subscribe);
+    mosquitto_message_v5_callback_set(broker->mosq, on_message_v5);
+    if (pthread_create(&broker->thread, NULL, broker_thread, broker) != 0) {
+        fprintf(stderr, "Could not start the broker thread for %s\n", config->host);
+        mosquitto_destroy(broker->mosq);
+        broker->mosq = NULL;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--foreground") == 0) foreground = true;
         if (strcmp(argv[i], "--verbose") == 0) verbose = true;
     }
+    tag_publish_config_init();
     load_config("/etc/ecowitt2mqtt.conf");
+    refresh_init();
+    command_routes_init();
+    tag_aggregates_init();
     if (!foreground) daemon(0,0);
     if (foreground) {
         printf("Starting in foreground\n");
         printf("Ecowitt host:%s port %d\n", weather_host, weather_port);
-        printf("MQTT host:%s port %d\n", mqtt_broker_host, mqtt_broker_port);
     }
     else {
         openlog("ecowitt2mqtt", LOG_PID, LOG_DAEMON);
     }
     
     unsigned char COMMAND_BUFFER[260]; // enough for max size (255) + 2 bytes header
-    unsigned char RECEIVE_BUFFER[1024];
-    struct mosquitto *mosq = NULL;
+    static FrameParser parser;
     int returnCode = 0;
     
     mosquitto_lib_init();
-    mosq = mosquitto_new(mqtt_clientid, true, NULL);
-    if (mosq) {
-        mosquitto_connect_callback_set(mosq, on_connect);
-        mosquitto_disconnect_callback_set(mosq, on_disconnect);
-        mosquitto_publish_callback_set(mosq, on_publish);
-        mosquitto_subscribe_callback_set(mosq, on_subscribe);
-        mosquitto_message_callback_set(mosq, on_message);
+    int started = 0;
+    for (int bi = 0; bi < mqtt_broker_count; bi++) {
+        started += broker_start(&mqtt_brokers[bi], &mqtt_broker_configs[bi]);
+    }
+    if (started && (http_port > 0)) {
+        http_start();
+    }
+    if (started) {
         
-        int rc = mosquitto_connect(mosq, mqtt_broker_host, mqtt_broker_port, 10); // Keepalive of 60 seconds
-        if (rc == MOSQ_ERR_SUCCESS) {
-            mosquitto_loop_start(mosq);
-            
-            mqtt_subscribe(mosq, TOPIC_ALL_DATA_REQUEST);
-            
-            int query_length = prepare_command_buffer(COMMAND_BUFFER, CMD_GW1000_LIVEDATA, NULL, 0);
+        int query_length = prepare_command_buffer(COMMAND_BUFFER, CMD_GW1000_LIVEDATA, NULL, 0);
+        
+        while (1) {
+            refresh_poll_begin();
+            int sock = gateway_connect();
+            if (sock < 0) {
+                refresh_answer(false);
+                poll_wait(interval);
+                continue;
+            }
             
-            while (1) {
-                int sock = socket(AF_INET, SOCK_STREAM, 0);
-                struct sockaddr_in addr = {0};
-                addr.sin_family = AF_INET;
-                addr.sin_port = htons(weather_port);
-                inet_aton(weather_host, &addr.sin_addr);
-                
-                if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-                    if (foreground) perror("connect"); else syslog(LOG_ERR, "connect failed");
-                    close(sock);
-                    sleep(interval);
-                    continue;
+            RawFrameSlot *slot = raw_frame_write_slot();
+            unsigned char *receive_buffer = slot->data;
+            ssize_t n = gateway_exchange(sock, COMMAND_BUFFER, query_length, &parser, receive_buffer);
+            if (foreground && verbose) {
+                printf("Received %ld bytes buffer:\n", n);
+                int i = 0;
+                while (i < n) {
+                    fprintf(stderr, "     ");
+                    for (int c = 0; c < 16; c++, i++) {
+                        if (i >= n) break;
+                        fprintf(stderr, "%02X ", receive_buffer[i]);
+                    }
+                    fprintf(stderr, "\n");
                 }
-                
-                send(sock, COMMAND_BUFFER, query_length, 0);
-                ssize_t n = recv(sock, RECEIVE_BUFFER, sizeof(RECEIVE_BUFFER), 0);
-                switch (check_receive_buffer(RECEIVE_BUFFER)) {
-                    case RECEIVE_BUFFER_OK:
-                        if (foreground && verbose) {
-                            printf("Received %ld bytes buffer:\n", n);
-                            int i = 0;
-                            while (i < n) {
-                                fprintf(stderr, "     ");
-                                for (int c = 0; c < 16; c++, i++) {
-                                    if (i >= n) break;
-                                    fprintf(stderr, "%02X ", RECEIVE_BUFFER[i]);
-                                }
-                                fprintf(stderr, "\n");
-                            }
-                        }
-                        parse_and_publish(RECEIVE_BUFFER, mosq);
-                        break;
+            }
+            if (parser.state == PARSER_STATE_DONE) {
+                frame_generation++;
+                frame_parser_commit(&parser, frame_generation);
+                raw_frame_publish(slot, parser.size + 2, frame_generation); // size excludes the 2 byte header
+            }
+            else {
+                switch (parser.error) {
                     case INVALID_HEADER:
-                        fprintf(stderr, "invalid header returned: 0x%02X%02X\n", RECEIVE_BUFFER[0], RECEIVE_BUFFER[1]);
+                        fprintf(stderr, "invalid header returned: 0x%02X%02X\n", receive_buffer[0], receive_buffer[1]);
                         break;
                     case INVALID_CHECKSUM:
                         fprintf(stderr, "invalid checksum\n");
@@ -663,26 +3572,31 @@ int main(int argc, char *argv[]) {
                     case INVALID_LENGTH:
                         fprintf(stderr, "invalid length\n");
                         break;
-                        
+                    default:
+                        fprintf(stderr, "incomplete reply, received %ld bytes\n", n);
+                        break;
                 }
-                
-                close(sock);
-                sleep(interval);
             }
-            mosquitto_disconnect(mosq);
-            mosquitto_loop_stop(mosq, true);
+            
+            close(sock);
+            refresh_answer(parser.state == PARSER_STATE_DONE);
+            poll_wait(interval);
         }
-        else {
-            fprintf(stderr, "Could not connect to MQTT server\n");
-            returnCode = 1;
+        for (int bi = 0; bi < mqtt_broker_count; bi++) {
+            if (mqtt_brokers[bi].mosq) {
+                mosquitto_disconnect(mqtt_brokers[bi].mosq);
+            }
         }
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
-        return returnCode;
     }
     else {
-        fprintf(stderr, "Could not create mosquitto object\n");
-        return 1;
+        fprintf(stderr, "Could not start any broker connection\n");
+        returnCode = 1;
+    }
+    for (int bi = 0; bi < mqtt_broker_count; bi++) {
+        if (mqtt_brokers[bi].mosq) {
+            mosquitto_destroy(mqtt_brokers[bi].mosq);
+        }
     }
+    mosquitto_lib_cleanup();
+    return returnCode;
 }
-
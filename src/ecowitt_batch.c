@@ -0,0 +1,186 @@
+/*
+ * ecowitt_batch.c
+ *
+ * Parallel columnar decoding of archived live data replies, see ecowitt_batch.h
+ *
+ * Every worker gets a contiguous range of frames and writes only its own rows, so there is no
+ * synchronisation beyond joining the workers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ecowitt_batch.h"
+
+typedef struct {
+    const EcowittFrame     *frames;
+    size_t                  begin;
+    size_t                  end;
+    EcowittColumns         *columns;
+    size_t                  verified;
+} BatchJob;
+
+
+#pragma mark -
+
+int ecowitt_columns_alloc(EcowittColumns *columns, size_t frameCount) {
+    memset(columns, 0, sizeof(*columns));
+    columns->frameCount = frameCount;
+    columns->timestamps = calloc(frameCount, sizeof(int64_t));
+    columns->valid = calloc(frameCount, sizeof(uint8_t));
+    if (!columns->timestamps || !columns->valid) {
+        ecowitt_columns_free(columns);
+        return -1;
+    }
+    for (int ti = 0; ti < TAG_COUNT; ti++) {
+        EcowittColumn *column = &columns->columns[ti];
+        column->spec = &tagData[ti];
+        column->exponent = tagTypeExponent(tagData[ti].type);
+        if (!tagTypeIsNumeric(tagData[ti].type)) {
+            continue;
+        }
+        column->values = calloc(frameCount, sizeof(int32_t));
+        column->present = calloc(frameCount, sizeof(uint8_t));
+        if (!column->values || !column->present) {
+            ecowitt_columns_free(columns);
+            return -1;
+        }
+        if (tagData[ti].type == TAG_TYPE_3_BYTES_TEMP_AND_BATT) {
+            column->battery = calloc(frameCount, sizeof(int32_t));
+            if (!column->battery) {
+                ecowitt_columns_free(columns);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+void ecowitt_columns_free(EcowittColumns *columns) {
+    free(columns->timestamps);
+    free(columns->valid);
+    for (int ti = 0; ti < TAG_COUNT; ti++) {
+        free(columns->columns[ti].values);
+        free(columns->columns[ti].present);
+        free(columns->columns[ti].battery);
+    }
+    memset(columns, 0, sizeof(*columns));
+}
+
+
+#pragma mark - Decoding
+
+static void batch_clear_row(EcowittColumns *columns, size_t row) {
+    for (int ti = 0; ti < TAG_COUNT; ti++) {
+        if (columns->columns[ti].present) {
+            columns->columns[ti].present[row] = 0;
+        }
+    }
+}
+
+// Same framing and tag walking rules as the daemon's parser: a frame is all or nothing,
+// and decoding stops at the first tag whose length can't be known. The row starts out empty,
+// so whatever a rejected frame got to write is gone
+static bool batch_decode_frame(const EcowittFrame *frame, size_t row, EcowittColumns *columns) {
+    batch_clear_row(columns, row);
+    FrameCursor cursor = cursor_make(frame->data, frame->length);
+    unsigned int header, command, size;
+    if (!cursor_read_be(&cursor, 2, &header) || (header != 0xFFFF)) return false;
+    if (!cursor_read_be(&cursor, 1, &command) || (command != CMD_GW1000_LIVEDATA)) return false;
+    if (!cursor_read_be(&cursor, 2, &size) || (size < 4) || (size + 2 > frame->length)) return false;
+
+    unsigned int checksum = 0;
+    for (unsigned int i = 2; i <= size; i++) {
+        checksum += frame->data[i];
+    }
+    if ((checksum % 256) != frame->data[size + 1]) return false;
+
+    FrameCursor data = cursor_take(&cursor, size - 4);
+    unsigned int tag;
+    TagValue value;
+    while (cursor_read_be(&data, 1, &tag)) {
+        int ti = tag_index(tag);
+        int length = (ti >= 0) ? tagTypeDataLength(tagData[ti].type) : 0;
+        if (length == 0) {
+            break;
+        }
+        FrameCursor tagCursor = cursor_take(&data, length);
+        if (tagCursor.remaining != (size_t)length) {
+            batch_clear_row(columns, row);
+            return false;
+        }
+        EcowittColumn *column = &columns->columns[ti];
+        if (column->values && decode_tag_value(ti, tagCursor, &value)) {
+            column->values[row] = value.value;
+            column->present[row] = 1;
+            if (column->battery) {
+                column->battery[row] = value.battery;
+            }
+        }
+    }
+    return true;
+}
+
+static void *batch_worker(void *arg) {
+    BatchJob *job = arg;
+    for (size_t row = job->begin; row < job->end; row++) {
+        job->columns->timestamps[row] = job->frames[row].timestamp;
+        job->columns->valid[row] = batch_decode_frame(&job->frames[row], row, job->columns);
+        job->verified += job->columns->valid[row];
+    }
+    return NULL;
+}
+
+size_t ecowitt_decode_batch(const EcowittFrame *frames, size_t count, EcowittColumns *columns, int threads) {
+    if (count > columns->frameCount) {
+        count = columns->frameCount;
+    }
+    if (threads <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cores > 0) ? (int)cores : 1;
+    }
+    if ((size_t)threads > count) {
+        threads = count ? (int)count : 1;
+    }
+    tag_index(0); // build the tag lookup before the workers race for it
+
+    BatchJob *jobs = calloc(threads, sizeof(BatchJob));
+    pthread_t *workers = calloc(threads, sizeof(pthread_t));
+    bool *started = calloc(threads, sizeof(bool));
+    if (!jobs || !workers || !started) {
+        free(jobs);
+        free(workers);
+        free(started);
+        BatchJob job = { .frames = frames, .begin = 0, .end = count, .columns = columns };
+        batch_worker(&job);
+        return job.verified;
+    }
+    size_t chunk = count / threads;
+    size_t extra = count % threads;
+    size_t begin = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t length = chunk + ((size_t)t < extra ? 1 : 0);
+        jobs[t] = (BatchJob){ .frames = frames, .begin = begin, .end = begin + length, .columns = columns };
+        begin += length;
+        started[t] = (t > 0) && (pthread_create(&workers[t], NULL, batch_worker, &jobs[t]) == 0);
+    }
+    // the calling thread takes the first range, and any range a worker couldn't be started for
+    for (int t = 0; t < threads; t++) {
+        if (!started[t]) {
+            batch_worker(&jobs[t]);
+        }
+    }
+    size_t verified = 0;
+    for (int t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+        }
+        verified += jobs[t].verified;
+    }
+    free(jobs);
+    free(workers);
+    free(started);
+    return verified;
+}
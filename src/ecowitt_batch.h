@@ -0,0 +1,45 @@
+/*
+  ecowitt_batch.h
+
+  Offline decoding of archived CMD_GW1000_LIVEDATA replies, for backfills.
+  Frames are decoded in parallel with the daemon's tag rules into columns: one
+  fixed point array per numeric tag, plus the timestamp of every frame.
+*/
+
+#ifndef ECOWITT_BATCH_H
+#define ECOWITT_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ecowitt_tags.h"
+
+typedef struct {
+    const unsigned char    *data;           // complete reply, from the 0xFFFF header to the checksum
+    size_t                  length;
+    int64_t                 timestamp;      // when the reply was captured
+} EcowittFrame;
+
+typedef struct {
+    const TagSpec          *spec;
+    int                     exponent;       // values are fixed point, value * 10^exponent
+    int32_t                *values;         // NULL for tags that don't decode to a number
+    uint8_t                *present;        // 1 where the frame carried the tag
+    int32_t                *battery;        // sensor battery, exponent TAG_BATTERY_EXPONENT, NULL if not reported
+} EcowittColumn;
+
+typedef struct {
+    size_t                  frameCount;
+    int64_t                *timestamps;
+    uint8_t                *valid;          // 1 where the frame verified, its row is empty otherwise
+    EcowittColumn           columns[TAG_COUNT];
+} EcowittColumns;
+
+// Allocates zeroed columns for frameCount frames, returns 0 on success
+int ecowitt_columns_alloc(EcowittColumns *columns, size_t frameCount);
+void ecowitt_columns_free(EcowittColumns *columns);
+
+// Decodes frames[0..count) into rows 0..count of columns using threads workers (0 for one per core), returns the number of frames that verified
+size_t ecowitt_decode_batch(const EcowittFrame *frames, size_t count, EcowittColumns *columns, int threads);
+
+#endif
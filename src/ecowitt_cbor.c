@@ -0,0 +1,115 @@
+/*
+ * ecowitt_cbor.c
+ *
+ * CBOR encoder, see ecowitt_cbor.h
+ */
+
+#include <string.h>
+
+#include "ecowitt_cbor.h"
+
+#define CBOR_MAJOR_UINT              0
+#define CBOR_MAJOR_NEGATIVE          1
+#define CBOR_MAJOR_TEXT              3
+#define CBOR_MAJOR_ARRAY             4
+#define CBOR_MAJOR_MAP               5
+#define CBOR_MAJOR_TAG               6
+#define CBOR_INDEFINITE              31
+#define CBOR_BREAK                   0xFF
+#define CBOR_NULL                    0xF6
+#define CBOR_TAG_DECIMAL_FRACTION    4
+
+
+CborWriter cbor_writer(uint8_t *buffer, size_t capacity) {
+    CborWriter writer = { .buffer = buffer, .capacity = capacity, .length = 0, .overflow = false };
+    return writer;
+}
+
+void cbor_put_bytes(CborWriter *writer, const void *bytes, size_t length) {
+    if (writer->overflow || (writer->length + length > writer->capacity)) {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buffer + writer->length, bytes, length);
+    writer->length += length;
+}
+
+// Initial byte and argument in the shortest form
+void cbor_put_head(CborWriter *writer, int major, uint64_t argument) {
+    uint8_t head[9];
+    size_t length;
+    if (argument < 24) {
+        head[0] = (major << 5) | argument;
+        length = 1;
+    }
+    else {
+        int width = (argument <= 0xFF) ? 1 : (argument <= 0xFFFF) ? 2 : (argument <= 0xFFFFFFFF) ? 4 : 8;
+        head[0] = (major << 5) | ((width == 1) ? 24 : (width == 2) ? 25 : (width == 4) ? 26 : 27);
+        for (int i = 0; i < width; i++) {
+            head[width - i] = (argument >> (8 * i)) & 0xFF;
+        }
+        length = 1 + width;
+    }
+    cbor_put_bytes(writer, head, length);
+}
+
+void cbor_put_uint(CborWriter *writer, uint64_t value) {
+    cbor_put_head(writer, CBOR_MAJOR_UINT, value);
+}
+
+void cbor_put_int(CborWriter *writer, int64_t value) {
+    if (value < 0) {
+        cbor_put_head(writer, CBOR_MAJOR_NEGATIVE, (uint64_t)(-1 - value));
+    }
+    else {
+        cbor_put_head(writer, CBOR_MAJOR_UINT, value);
+    }
+}
+
+void cbor_put_text(CborWriter *writer, const char *text) {
+    size_t length = strlen(text);
+    cbor_put_head(writer, CBOR_MAJOR_TEXT, length);
+    cbor_put_bytes(writer, text, length);
+}
+
+void cbor_put_array(CborWriter *writer, size_t count) {
+    cbor_put_head(writer, CBOR_MAJOR_ARRAY, count);
+}
+
+void cbor_put_map(CborWriter *writer, size_t count) {
+    cbor_put_head(writer, CBOR_MAJOR_MAP, count);
+}
+
+void cbor_put_null(CborWriter *writer) {
+    uint8_t null = CBOR_NULL;
+    cbor_put_bytes(writer, &null, 1);
+}
+
+void cbor_put_map_begin(CborWriter *writer) {
+    uint8_t head = (CBOR_MAJOR_MAP << 5) | CBOR_INDEFINITE;
+    cbor_put_bytes(writer, &head, 1);
+}
+
+void cbor_put_end(CborWriter *writer) {
+    uint8_t stop = CBOR_BREAK;
+    cbor_put_bytes(writer, &stop, 1);
+}
+
+void cbor_put_decimal(CborWriter *writer, int64_t mantissa, int exponent) {
+    if (exponent == 0) {
+        cbor_put_int(writer, mantissa);
+        return;
+    }
+    cbor_put_head(writer, CBOR_MAJOR_TAG, CBOR_TAG_DECIMAL_FRACTION);
+    cbor_put_array(writer, 2);
+    cbor_put_int(writer, exponent);
+    cbor_put_int(writer, mantissa);
+}
+
+void cbor_put_tag_value(CborWriter *writer, const TagValue *value) {
+    cbor_put_decimal(writer, value->value, value->exponent);
+}
+
+void cbor_put_tag_battery(CborWriter *writer, const TagValue *value) {
+    cbor_put_decimal(writer, value->battery, TAG_BATTERY_EXPONENT);
+}
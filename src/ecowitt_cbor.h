@@ -0,0 +1,41 @@
+/*
+  ecowitt_cbor.h
+
+  Minimal CBOR (RFC 8949) encoder for tag values: integers, text strings, null, maps and arrays, and
+  decimal fractions (tag 4, [exponent, mantissa]) for the fixed point values of TagValue.
+  Writes into a caller supplied buffer and flags an overflow instead of writing past it.
+*/
+
+#ifndef ECOWITT_CBOR_H
+#define ECOWITT_CBOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ecowitt_tags.h"
+
+typedef struct {
+    uint8_t                *buffer;
+    size_t                  capacity;
+    size_t                  length;
+    bool                    overflow;
+} CborWriter;
+
+CborWriter cbor_writer(uint8_t *buffer, size_t capacity);
+
+void cbor_put_uint(CborWriter *writer, uint64_t value);
+void cbor_put_int(CborWriter *writer, int64_t value);
+void cbor_put_text(CborWriter *writer, const char *text);
+void cbor_put_null(CborWriter *writer);
+void cbor_put_array(CborWriter *writer, size_t count);
+void cbor_put_map(CborWriter *writer, size_t count);
+void cbor_put_map_begin(CborWriter *writer);        // indefinite length map, closed by cbor_put_end()
+void cbor_put_end(CborWriter *writer);
+
+// mantissa * 10^exponent: a plain integer when the exponent is 0, a decimal fraction otherwise
+void cbor_put_decimal(CborWriter *writer, int64_t mantissa, int exponent);
+void cbor_put_tag_value(CborWriter *writer, const TagValue *value);
+void cbor_put_tag_battery(CborWriter *writer, const TagValue *value);
+
+#endif
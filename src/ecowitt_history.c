@@ -0,0 +1,224 @@
+/*
+ * ecowitt_history.c
+ *
+ * Compressed per-tag history, see ecowitt_history.h
+ *
+ * Bit fields, most significant bit first:
+ *   timestamp delta of delta   0 | 10 + 7 bits | 110 + 9 bits | 1110 + 12 bits | 1111 + 32 bits
+ *   value delta (zigzag)       0 | 10 + 6 bits | 110 + 13 bits | 111 + 33 bits
+ * The widest point takes 72 bits, a block is closed once less than that is left.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecowitt_history.h"
+
+#define HISTORY_BLOCK_BYTES          4096
+#define HISTORY_POINT_MAX_BITS       72
+
+struct HistoryBlock {
+    HistoryBlock           *next;
+    int64_t                 firstTimestamp;
+    int64_t                 lastTimestamp;
+    int32_t                 firstValue;
+    uint32_t                count;          // points, the first one included
+    uint32_t                bits;           // bits written to data
+    // writer state
+    int64_t                 lastDelta;
+    int32_t                 lastValue;
+    uint8_t                 data[HISTORY_BLOCK_BYTES];
+};
+
+typedef struct {
+    const HistoryBlock     *block;
+    uint32_t                bit;
+} HistoryReader;
+
+
+#pragma mark - Bits
+
+void history_write_bits(HistoryBlock *block, uint64_t value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        if ((value >> i) & 1) {
+            block->data[block->bits >> 3] |= 0x80 >> (block->bits & 7);
+        }
+        block->bits++;
+    }
+}
+
+uint64_t history_read_bits(HistoryReader *reader, int width) {
+    uint64_t value = 0;
+    for (int i = 0; i < width; i++, reader->bit++) {
+        value = (value << 1) | ((reader->block->data[reader->bit >> 3] >> (7 - (reader->bit & 7))) & 1);
+    }
+    return value;
+}
+
+uint64_t history_zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t history_unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Sign extends the low width bits of value
+int64_t history_signed(uint64_t value, int width) {
+    uint64_t sign = (uint64_t)1 << (width - 1);
+    return (int64_t)((value ^ sign) - sign);
+}
+
+
+#pragma mark - Encoding
+
+void history_write_timestamp(HistoryBlock *block, int64_t dod) {
+    if (dod == 0) {
+        history_write_bits(block, 0, 1);
+    }
+    else if ((dod >= -64) && (dod < 64)) {
+        history_write_bits(block, 0x2, 2);
+        history_write_bits(block, dod & 0x7F, 7);
+    }
+    else if ((dod >= -256) && (dod < 256)) {
+        history_write_bits(block, 0x6, 3);
+        history_write_bits(block, dod & 0x1FF, 9);
+    }
+    else if ((dod >= -2048) && (dod < 2048)) {
+        history_write_bits(block, 0xE, 4);
+        history_write_bits(block, dod & 0xFFF, 12);
+    }
+    else {
+        history_write_bits(block, 0xF, 4);
+        history_write_bits(block, dod & 0xFFFFFFFF, 32);
+    }
+}
+
+int64_t history_read_timestamp(HistoryReader *reader) {
+    if (history_read_bits(reader, 1) == 0) return 0;
+    if (history_read_bits(reader, 1) == 0) return history_signed(history_read_bits(reader, 7), 7);
+    if (history_read_bits(reader, 1) == 0) return history_signed(history_read_bits(reader, 9), 9);
+    if (history_read_bits(reader, 1) == 0) return history_signed(history_read_bits(reader, 12), 12);
+    return history_signed(history_read_bits(reader, 32), 32);
+}
+
+void history_write_value(HistoryBlock *block, int64_t delta) {
+    uint64_t zigzag = history_zigzag(delta);
+    if (zigzag == 0) {
+        history_write_bits(block, 0, 1);
+    }
+    else if (zigzag < (1 << 6)) {
+        history_write_bits(block, 0x2, 2);
+        history_write_bits(block, zigzag, 6);
+    }
+    else if (zigzag < (1 << 13)) {
+        history_write_bits(block, 0x6, 3);
+        history_write_bits(block, zigzag, 13);
+    }
+    else {
+        history_write_bits(block, 0x7, 3);
+        history_write_bits(block, zigzag, 33);
+    }
+}
+
+int64_t history_read_value(HistoryReader *reader) {
+    if (history_read_bits(reader, 1) == 0) return 0;
+    if (history_read_bits(reader, 1) == 0) return history_unzigzag(history_read_bits(reader, 6));
+    if (history_read_bits(reader, 1) == 0) return history_unzigzag(history_read_bits(reader, 13));
+    return history_unzigzag(history_read_bits(reader, 33));
+}
+
+
+#pragma mark -
+
+void history_series_init(HistorySeries *series) {
+    memset(series, 0, sizeof(*series));
+}
+
+void history_series_free(HistorySeries *series) {
+    HistoryBlock *block = series->head;
+    while (block) {
+        HistoryBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    history_series_init(series);
+}
+
+bool history_append(HistorySeries *series, int64_t timestamp, int32_t value) {
+    HistoryBlock *block = series->tail;
+    int64_t delta = block ? timestamp - block->lastTimestamp : 0;
+    int64_t dod = block ? delta - block->lastDelta : 0;
+    if ((block == NULL) || (block->bits + HISTORY_POINT_MAX_BITS > HISTORY_BLOCK_BYTES * 8) || (dod < INT32_MIN) || (dod > INT32_MAX)) {
+        block = calloc(1, sizeof(HistoryBlock));
+        if (block == NULL) {
+            return false;
+        }
+        block->firstTimestamp = block->lastTimestamp = timestamp;
+        block->firstValue = block->lastValue = value;
+        block->count = 1;
+        if (series->tail) {
+            series->tail->next = block;
+        }
+        else {
+            series->head = block;
+        }
+        series->tail = block;
+        series->blocks++;
+        series->count++;
+        return true;
+    }
+    history_write_timestamp(block, dod);
+    history_write_value(block, (int64_t)value - block->lastValue);
+    block->lastTimestamp = timestamp;
+    block->lastDelta = delta;
+    block->lastValue = value;
+    block->count++;
+    series->count++;
+    return true;
+}
+
+void history_trim(HistorySeries *series, int64_t oldest) {
+    while (series->head && (series->head->lastTimestamp < oldest)) {
+        HistoryBlock *block = series->head;
+        series->head = block->next;
+        if (series->head == NULL) {
+            series->tail = NULL;
+        }
+        series->blocks--;
+        series->count -= block->count;
+        free(block);
+    }
+}
+
+uint64_t history_query(const HistorySeries *series, int64_t since, uint64_t skip, HistoryVisitor visitor, void *context) {
+    uint64_t matched = 0;
+    for (const HistoryBlock *block = series->head; block; block = block->next) {
+        if (block->lastTimestamp < since) {
+            continue;
+        }
+        HistoryReader reader = { .block = block, .bit = 0 };
+        int64_t timestamp = block->firstTimestamp;
+        int64_t delta = 0;
+        int64_t value = block->firstValue;
+        for (uint32_t point = 0; point < block->count; point++) {
+            if (point > 0) {
+                delta += history_read_timestamp(&reader);
+                timestamp += delta;
+                value += history_read_value(&reader);
+            }
+            if (timestamp < since) {
+                continue;
+            }
+            if (visitor && (matched >= skip)) {
+                visitor(context, timestamp, (int32_t)value);
+            }
+            matched++;
+        }
+    }
+    return matched;
+}
+
+size_t history_bytes(const HistorySeries *series) {
+    return series->blocks * sizeof(HistoryBlock);
+}
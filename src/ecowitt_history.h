@@ -0,0 +1,45 @@
+/*
+  ecowitt_history.h
+
+  Per-tag history in RAM, compressed Gorilla style: timestamps as delta of delta and fixed point
+  values as the zigzag delta from the previous value, both in variable length bit fields, so a tag
+  polled at a steady interval with a slowly moving value takes a few bits per point. A series is a
+  list of fixed size blocks, each starting with an uncompressed point, so the oldest block can be
+  dropped when it falls out of the retention window.
+  Not thread safe, callers lock around appends and queries.
+*/
+
+#ifndef ECOWITT_HISTORY_H
+#define ECOWITT_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct HistoryBlock HistoryBlock;
+
+typedef struct {
+    HistoryBlock           *head;           // oldest block, NULL when empty
+    HistoryBlock           *tail;           // block being written
+    size_t                  blocks;
+    uint64_t                count;          // points in all blocks
+} HistorySeries;
+
+typedef void (*HistoryVisitor)(void *context, int64_t timestamp, int32_t value);
+
+void history_series_init(HistorySeries *series);
+void history_series_free(HistorySeries *series);
+
+// Appends a point, timestamps must not go back. Returns false when out of memory
+bool history_append(HistorySeries *series, int64_t timestamp, int32_t value);
+
+// Drops the blocks whose points are all older than oldest
+void history_trim(HistorySeries *series, int64_t oldest);
+
+// Calls visitor (when not NULL) with the points from since on, oldest first, skipping the first skip of them.
+// Returns the number of points from since on
+uint64_t history_query(const HistorySeries *series, int64_t since, uint64_t skip, HistoryVisitor visitor, void *context);
+
+size_t history_bytes(const HistorySeries *series);
+
+#endif
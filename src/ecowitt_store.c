@@ -0,0 +1,241 @@
+/*
+ * ecowitt_store.c
+ *
+ * Store and forward ring, see ecowitt_store.h
+ *
+ * File layout: a header, then the data area holding variable length records one after the other,
+ * each a StoreRecordHeader followed by its payload, padded to 8 bytes. A record never wraps: when it
+ * doesn't fit before the end of the data area, a wrap marker is written and it goes at the start.
+ * Each record carries a check over its header and payload. The file can be left torn by a crash or a
+ * power loss, so a record is only read once it lies within the data area and its check matches; when
+ * one doesn't, the ring is emptied rather than replaying garbage.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ecowitt_store.h"
+
+#define STORE_MAGIC                  0x46535745 // "EWSF"
+#define STORE_VERSION                2
+#define STORE_WRAP_MARKER            0xFFFFFFFFu
+#define STORE_ALIGN(n)               (((n) + 7) & ~(uint64_t)7)
+
+struct StoreRingHeader {
+    uint32_t                magic;
+    uint32_t                version;
+    uint64_t                capacity;       // bytes in the data area
+    uint64_t                head;           // offset of the oldest record
+    uint64_t                tail;           // offset the next record is written at
+    uint64_t                count;
+    uint64_t                dropped;
+};
+
+typedef struct {
+    uint32_t                length;         // payload bytes, or STORE_WRAP_MARKER
+    uint32_t                check;          // FNV-1a over the other fields and the payload
+    int64_t                 timestamp;
+    uint64_t                sequence;
+} StoreRecordHeader;
+
+
+#pragma mark -
+
+uint32_t store_record_check(const StoreRecordHeader *record, const unsigned char *payload) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *fields[] = { (const unsigned char *)&record->length, (const unsigned char *)&record->timestamp,
+                                      (const unsigned char *)&record->sequence, payload };
+    const size_t lengths[] = { sizeof(record->length), sizeof(record->timestamp), sizeof(record->sequence), record->length };
+    for (int fi = 0; fi < 4; fi++) {
+        for (size_t i = 0; i < lengths[fi]; i++) {
+            hash = (hash ^ fields[fi][i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+// The record at head, NULL when it runs past the data area or its check doesn't match
+StoreRecordHeader *store_ring_head_record(StoreRing *ring) {
+    StoreRingHeader *header = ring->header;
+    if (header->head + sizeof(StoreRecordHeader) > header->capacity) {
+        return NULL;
+    }
+    StoreRecordHeader *record = (StoreRecordHeader *)(ring->data + header->head);
+    if ((record->length == STORE_WRAP_MARKER) || (header->head + STORE_ALIGN(sizeof(StoreRecordHeader) + record->length) > header->capacity)
+        || (record->check != store_record_check(record, ring->data + header->head + sizeof(StoreRecordHeader)))) {
+        return NULL;
+    }
+    return record;
+}
+
+// Empties a ring found corrupted, its records count as dropped
+void store_ring_reset(StoreRing *ring) {
+    StoreRingHeader *header = ring->header;
+    fprintf(stderr, "Store record at %llu is corrupted, dropping the %llu stored records\n",
+            (unsigned long long)header->head, (unsigned long long)header->count);
+    header->dropped += header->count;
+    header->count = 0;
+    header->head = header->tail = 0;
+    msync(ring->header, ring->mappedSize, MS_ASYNC);
+}
+
+int store_ring_open(StoreRing *ring, const char *path, size_t capacity) {
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    capacity = STORE_ALIGN(capacity);
+    if (capacity < 4096) {
+        capacity = 4096;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("store open");
+        return -1;
+    }
+    size_t mappedSize = sizeof(StoreRingHeader) + capacity;
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || (((size_t)st.st_size != mappedSize) && (ftruncate(fd, mappedSize) < 0))) {
+        perror("store size");
+        close(fd);
+        return -1;
+    }
+    void *mapping = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        perror("store mmap");
+        close(fd);
+        return -1;
+    }
+    ring->fd = fd;
+    ring->mappedSize = mappedSize;
+    ring->header = mapping;
+    ring->data = (unsigned char *)mapping + sizeof(StoreRingHeader);
+    StoreRingHeader *header = ring->header;
+    if ((header->magic != STORE_MAGIC) || (header->version != STORE_VERSION) || (header->capacity != capacity)
+        || (header->head >= capacity) || (header->tail >= capacity) || ((header->head | header->tail) & 7)) {
+        // new file, or one written with another layout or size: start empty
+        memset(header, 0, sizeof(*header));
+        header->magic = STORE_MAGIC;
+        header->version = STORE_VERSION;
+        header->capacity = capacity;
+    }
+    return 0;
+}
+
+void store_ring_close(StoreRing *ring) {
+    if (ring->header) {
+        msync(ring->header, ring->mappedSize, MS_SYNC);
+        munmap(ring->header, ring->mappedSize);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Wraps head to the start of the data area when it sits on a wrap marker or too close to the end
+void store_ring_normalize_head(StoreRing *ring) {
+    StoreRingHeader *header = ring->header;
+    if ((header->head + sizeof(StoreRecordHeader) > header->capacity)
+        || (((StoreRecordHeader *)(ring->data + header->head))->length == STORE_WRAP_MARKER)) {
+        header->head = 0;
+    }
+}
+
+void store_ring_pop(StoreRing *ring) {
+    StoreRingHeader *header = ring->header;
+    if (!header || (header->count == 0)) {
+        return;
+    }
+    store_ring_normalize_head(ring);
+    StoreRecordHeader *record = store_ring_head_record(ring);
+    if (record == NULL) {
+        store_ring_reset(ring);
+        return;
+    }
+    header->head += STORE_ALIGN(sizeof(StoreRecordHeader) + record->length);
+    if (--header->count == 0) {
+        header->head = header->tail = 0;
+    } else {
+        store_ring_normalize_head(ring);
+    }
+}
+
+bool store_ring_append(StoreRing *ring, uint64_t sequence, int64_t timestamp, const void *payload, size_t length) {
+    StoreRingHeader *header = ring->header;
+    if (!header) {
+        return false;
+    }
+    uint64_t size = STORE_ALIGN(sizeof(StoreRecordHeader) + length);
+    if (size > header->capacity) {
+        return false;
+    }
+    while (1) {
+        if (header->count == 0) {
+            header->head = header->tail = 0;
+            break;
+        }
+        if (header->tail > header->head) {
+            if (header->tail + size <= header->capacity) {
+                break;
+            }
+            // no room before the end, continue at the start
+            if (header->tail + sizeof(uint32_t) <= header->capacity) {
+                ((StoreRecordHeader *)(ring->data + header->tail))->length = STORE_WRAP_MARKER;
+            }
+            header->tail = 0;
+            continue;
+        }
+        if (header->tail + size <= header->head) {
+            break;
+        }
+        // tail caught up with head: drop the oldest record to make room
+        uint64_t count = header->count;
+        store_ring_pop(ring);
+        if (header->count + 1 == count) {
+            header->dropped++;
+        }
+    }
+    StoreRecordHeader *record = (StoreRecordHeader *)(ring->data + header->tail);
+    record->length = length;
+    record->timestamp = timestamp;
+    record->sequence = sequence;
+    memcpy(ring->data + header->tail + sizeof(StoreRecordHeader), payload, length);
+    record->check = store_record_check(record, payload);
+    header->tail += size;
+    if (header->tail >= header->capacity) {
+        header->tail = 0;
+    }
+    header->count++;
+    msync(ring->header, ring->mappedSize, MS_ASYNC);
+    return true;
+}
+
+bool store_ring_peek(StoreRing *ring, StoreRecord *record) {
+    StoreRingHeader *header = ring->header;
+    if (!header || (header->count == 0)) {
+        return false;
+    }
+    store_ring_normalize_head(ring);
+    StoreRecordHeader *stored = store_ring_head_record(ring);
+    if (stored == NULL) {
+        store_ring_reset(ring);
+        return false;
+    }
+    record->sequence = stored->sequence;
+    record->timestamp = stored->timestamp;
+    record->length = stored->length;
+    record->payload = ring->data + header->head + sizeof(StoreRecordHeader);
+    return true;
+}
+
+uint64_t store_ring_count(const StoreRing *ring) {
+    return ring->header ? ring->header->count : 0;
+}
+
+uint64_t store_ring_dropped(const StoreRing *ring) {
+    return ring->header ? ring->header->dropped : 0;
+}
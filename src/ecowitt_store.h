@@ -0,0 +1,44 @@
+/*
+  ecowitt_store.h
+
+  Store and forward: a bounded ring of timestamped messages in a memory mapped file,
+  filled while the broker is unreachable and drained in order once it is back.
+  When the ring is full the oldest messages are dropped. The ring survives restarts.
+  Not thread safe, a ring is only used from one thread.
+*/
+
+#ifndef ECOWITT_STORE_H
+#define ECOWITT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct StoreRingHeader StoreRingHeader;
+
+typedef struct {
+    int                     fd;
+    size_t                  mappedSize;
+    StoreRingHeader        *header;
+    unsigned char          *data;
+} StoreRing;
+
+typedef struct {
+    uint64_t                sequence;
+    int64_t                 timestamp;
+    const unsigned char    *payload;       // points into the mapping, valid until the next append or pop
+    size_t                  length;
+} StoreRecord;
+
+// Opens or creates the ring file with room for capacity bytes of records, returns 0 on success
+int store_ring_open(StoreRing *ring, const char *path, size_t capacity);
+void store_ring_close(StoreRing *ring);
+
+bool store_ring_append(StoreRing *ring, uint64_t sequence, int64_t timestamp, const void *payload, size_t length);
+bool store_ring_peek(StoreRing *ring, StoreRecord *record);
+void store_ring_pop(StoreRing *ring);
+
+uint64_t store_ring_count(const StoreRing *ring);
+uint64_t store_ring_dropped(const StoreRing *ring);
+
+#endif
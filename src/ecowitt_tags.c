@@ -0,0 +1,389 @@
+/*
+ * ecowitt_tags.c
+ *
+ * Live data tag table and decoding rules, see ecowitt_tags.h
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "ecowitt_tags.h"
+
+
+#pragma mark -
+
+int tagTypeDataLength(TAG_PROCESSING_TYPE tagType) {
+    switch (tagType) {
+        case TAG_TYPE_BYTE_LEAVE_ALONE:
+            return 1;
+        case TAG_TYPE_SHORT_LEAVE_ALONE:
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
+            return 2;
+        case TAG_TYPE_3_BYTES_LEAVE_ALONE:
+        case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
+        case TAG_TYPE_3_BYTES_TIME:
+            return 3;
+        case TAG_TYPE_INT_LEAVE_ALONE:
+            return 4;
+        case TAG_TYPE_6_BYTES_TIME:
+            return 6;
+        case TAG_TYPE_16_BYTES_BITMASK:
+        case TAG_TYPE_16_BYTES_CO2:
+            return 16;
+        case TAG_TYPE_20_BYTES_PIEZO_GAIN:
+            return 20;
+        case TAG_TYPE_PM25_AQI:
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// Decimal exponent of the fixed point value decode_tag_value() produces for a tag type
+int tagTypeExponent(TAG_PROCESSING_TYPE tagType) {
+    switch (tagType) {
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
+        case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
+            return -1;
+        default:
+            return 0;
+    }
+}
+
+bool tagTypeIsNumeric(TAG_PROCESSING_TYPE tagType) {
+    switch (tagType) {
+        case TAG_TYPE_BYTE_LEAVE_ALONE:
+        case TAG_TYPE_SHORT_LEAVE_ALONE:
+        case TAG_TYPE_3_BYTES_LEAVE_ALONE:
+        case TAG_TYPE_INT_LEAVE_ALONE:
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
+        case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+TagSpec tagData[TAG_COUNT] = {
+    { .tag = ITEM_INTEMP                , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/indoors" },
+    { .tag = ITEM_OUTTEMP               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/outdoors" },
+    { .tag = ITEM_DEWPOINT              , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "dew_point" },
+    { .tag = ITEM_WINDCHILL             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "wind_chill" },
+    { .tag = ITEM_HEATINDEX             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "heat_index" },
+    { .tag = ITEM_INHUMI                , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/indoors" },
+    { .tag = ITEM_OUTHUMI               , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/outdoors" },
+    { .tag = ITEM_ABSBARO               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED  , .topic = "barometric/absolute" },
+    { .tag = ITEM_RELBARO               , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED  , .topic = "barometric/relative" },
+    { .tag = ITEM_WINDDIRECTION         , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/direction" },
+    { .tag = ITEM_WINDSPEED             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/speed" },
+    { .tag = ITEM_GUSTSPEED             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/gust_speed" },
+    { .tag = ITEM_RAINEVENT             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/event" },
+    { .tag = ITEM_RAINRATE              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/rate" },
+    { .tag = ITEM_RAINHOUR              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/hour" },
+    { .tag = ITEM_RAINDAY               , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/day" },
+    { .tag = ITEM_RAINWEEK              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/week" },
+    { .tag = ITEM_RAINMONTH             , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/month" },
+    { .tag = ITEM_RAINYEAR              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/year" },
+    { .tag = ITEM_RAINTOTALS            , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/totals" },
+    { .tag = ITEM_LIGHT                 , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "light" },
+    { .tag = ITEM_UV                    , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "uv/intensity" },
+    { .tag = ITEM_UVI                   , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "uv/index" },
+    { .tag = ITEM_TIME                  , .type = TAG_TYPE_6_BYTES_TIME                 , .topic = "date_and_time" },
+    { .tag = ITEM_DAYLWINDMAX           , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "wind/day_max" },
+    { .tag = ITEM_TEMP1                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_1" },
+    { .tag = ITEM_TEMP2                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_2" },
+    { .tag = ITEM_TEMP3                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_3" },
+    { .tag = ITEM_TEMP4                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_4" },
+    { .tag = ITEM_TEMP5                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_5" },
+    { .tag = ITEM_TEMP6                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_6" },
+    { .tag = ITEM_TEMP7                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_7" },
+    { .tag = ITEM_TEMP8                 , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/th_8" },
+    { .tag = ITEM_HUMI1                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_1" },
+    { .tag = ITEM_HUMI2                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_2" },
+    { .tag = ITEM_HUMI3                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_3" },
+    { .tag = ITEM_HUMI4                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_4" },
+    { .tag = ITEM_HUMI5                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_5" },
+    { .tag = ITEM_HUMI6                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_6" },
+    { .tag = ITEM_HUMI7                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_7" },
+    { .tag = ITEM_HUMI8                 , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "humidity/th_8" },
+    { .tag = ITEM_PM25_CH1              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "air_quality" },
+    { .tag = ITEM_SOILTEMP1             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_1" },
+    { .tag = ITEM_SOILMOISTURE1         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_1" },
+    { .tag = ITEM_SOILTEMP2             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_2" },
+    { .tag = ITEM_SOILMOISTURE2         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_2" },
+    { .tag = ITEM_SOILTEMP3             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_3" },
+    { .tag = ITEM_SOILMOISTURE3         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_3" },
+    { .tag = ITEM_SOILTEMP4             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_4" },
+    { .tag = ITEM_SOILMOISTURE4         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_4" },
+    { .tag = ITEM_SOILTEMP5             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_5" },
+    { .tag = ITEM_SOILMOISTURE5         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_5" },
+    { .tag = ITEM_SOILTEMP6             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_6" },
+    { .tag = ITEM_SOILMOISTURE6         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_6" },
+    { .tag = ITEM_SOILTEMP7             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_7" },
+    { .tag = ITEM_SOILMOISTURE7         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_7" },
+    { .tag = ITEM_SOILTEMP8             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_8" },
+    { .tag = ITEM_SOILMOISTURE8         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_8" },
+    { .tag = ITEM_SOILTEMP9             , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_9" },
+    { .tag = ITEM_SOILMOISTURE9         , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_9" },
+    { .tag = ITEM_SOILTEMP10            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_10" },
+    { .tag = ITEM_SOILMOISTURE10        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_10" },
+    { .tag = ITEM_SOILTEMP11            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_11" },
+    { .tag = ITEM_SOILMOISTURE11        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_11" },
+    { .tag = ITEM_SOILTEMP12            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_12" },
+    { .tag = ITEM_SOILMOISTURE12        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_12" },
+    { .tag = ITEM_SOILTEMP13            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_13" },
+    { .tag = ITEM_SOILMOISTURE13        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_13" },
+    { .tag = ITEM_SOILTEMP14            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_14" },
+    { .tag = ITEM_SOILMOISTURE14        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_14" },
+    { .tag = ITEM_SOILTEMP15            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_15" },
+    { .tag = ITEM_SOILMOISTURE15        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_15" },
+    { .tag = ITEM_SOILTEMP16            , .type = TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED    , .topic = "temperature/soil_16" },
+    { .tag = ITEM_SOILMOISTURE16        , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "moisture/soil_16" },
+    { .tag = ITEM_LOWBATT               , .type = TAG_TYPE_16_BYTES_BITMASK             , .topic = "all_sensor_low_battery" },
+    { .tag = ITEM_PM25_24HAVG1          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch1" },
+    { .tag = ITEM_PM25_24HAVG2          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch2" },
+    { .tag = ITEM_PM25_24HAVG3          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch3" },
+    { .tag = ITEM_PM25_24HAVG4          , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "pm25/ch4" },
+    { .tag = ITEM_PM25_CH2              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/2" },
+    { .tag = ITEM_PM25_CH3              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/3" },
+    { .tag = ITEM_PM25_CH4              , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "aqs/4" },
+    { .tag = ITEM_LEAK_CH1              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/1" },
+    { .tag = ITEM_LEAK_CH2              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/2" },
+    { .tag = ITEM_LEAK_CH3              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/3" },
+    { .tag = ITEM_LEAK_CH4              , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leak/4" },
+    { .tag = ITEM_LIGHTNING             , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "lightning/distance" },
+    { .tag = ITEM_LIGHTNING_TIME        , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "lightning/time" },
+    { .tag = ITEM_LIGHTNING_POWER       , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "lightning/day_counter" },
+    { .tag = ITEM_TF_USR1               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t1" },
+    { .tag = ITEM_TF_USR2               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t2" },
+    { .tag = ITEM_TF_USR3               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t3" },
+    { .tag = ITEM_TF_USR4               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t4" },
+    { .tag = ITEM_TF_USR5               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t5" },
+    { .tag = ITEM_TF_USR6               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t6" },
+    { .tag = ITEM_TF_USR7               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t7" },
+    { .tag = ITEM_TF_USR8               , .type = TAG_TYPE_3_BYTES_TEMP_AND_BATT        , .topic = "temperature/t8" },
+    { .tag = ITEM_SENSOR_CO2            , .type = TAG_TYPE_16_BYTES_CO2                 , .topic = "co2" },
+    { .tag = ITEM_PM25_AQI              , .type = TAG_TYPE_PM25_AQI                     , .topic = "aqi" },
+    { .tag = ITEM_LEAF_WETNESS_CH1      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/1" },
+    { .tag = ITEM_LEAF_WETNESS_CH2      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/2" },
+    { .tag = ITEM_LEAF_WETNESS_CH3      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/3" },
+    { .tag = ITEM_LEAF_WETNESS_CH4      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/4" },
+    { .tag = ITEM_LEAF_WETNESS_CH5      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/5" },
+    { .tag = ITEM_LEAF_WETNESS_CH6      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/6" },
+    { .tag = ITEM_LEAF_WETNESS_CH7      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/7" },
+    { .tag = ITEM_LEAF_WETNESS_CH8      , .type = TAG_TYPE_BYTE_LEAVE_ALONE             , .topic = "leaf_wetness/8" },
+    { .tag = ITEM_Piezo_Rain_Rate       , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/rate" },
+    { .tag = ITEM_Piezo_Event_Rain      , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/event" },
+    { .tag = ITEM_Piezo_Hourly_Rain     , .type = TAG_TYPE_SHORT_LEAVE_ALONE            , .topic = "rain/piezo/hourly" },
+    { .tag = ITEM_Piezo_Daily_Rain      , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/daily" },
+    { .tag = ITEM_Piezo_Weekly_Rain     , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/weekly" },
+    { .tag = ITEM_Piezo_Monthly_Rain    , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/monthly" },
+    { .tag = ITEM_Piezo_yearly_Rain     , .type = TAG_TYPE_INT_LEAVE_ALONE              , .topic = "rain/piezo/yearly" },
+    { .tag = ITEM_Piezo_Gain10          , .type = TAG_TYPE_20_BYTES_PIEZO_GAIN          , .topic = "rain/piezo/gain" },
+    { .tag = ITEM_RST_RainTime          , .type = TAG_TYPE_3_BYTES_TIME                 , .topic = "rain/rst/time" },
+};
+
+_Static_assert(sizeof(tagData) / sizeof(tagData[0]) == TAG_COUNT, "TAG_COUNT doesn't match the tag table");
+
+
+#pragma mark -
+
+signed char tag_lookup[256];
+pthread_once_t tag_lookup_once = PTHREAD_ONCE_INIT;
+
+void tag_lookup_init(void) {
+    for (int i = 0; i < 256; i++) {
+        tag_lookup[i] = -1;
+    }
+    for (int i = 0; i < TAG_COUNT; i++) {
+        tag_lookup[tagData[i].tag] = i;
+    }
+}
+
+int tag_count(void) {
+    return TAG_COUNT;
+}
+
+int tag_index(int tag) {
+    if ((tag < 0) || (tag > 0xFF)) {
+        return -1;
+    }
+    pthread_once(&tag_lookup_once, tag_lookup_init);
+    return tag_lookup[tag];
+}
+
+
+#pragma mark - Topic trie
+
+/*
+ * Prefix trie over the tag topics, one node per character, children in character order. Tags are
+ * numbered in trie order, so the tags below any node are one contiguous run of tag_trie_order: a prefix
+ * lookup walks the characters of the prefix and hands back that run, whatever its length.
+ */
+#define TAG_TRIE_MAX_NODES           2048 // the topics add up to about 1600 characters
+
+typedef struct {
+    char                    c;
+    short                   child;              // first child, -1 for none
+    short                   sibling;            // next child of the same parent, -1 for none
+    short                   tag;                // tag whose topic ends here, -1 for none
+    short                   first;              // run of tag_trie_order below this node, itself included
+    short                   end;
+} TagTrieNode;
+
+TagTrieNode tag_trie[TAG_TRIE_MAX_NODES];
+int tag_trie_nodes = 0;
+int tag_trie_order[TAG_COUNT];
+pthread_once_t tag_trie_once = PTHREAD_ONCE_INIT;
+
+int tag_trie_node(char c) {
+    if (tag_trie_nodes == TAG_TRIE_MAX_NODES) {
+        return -1;
+    }
+    tag_trie[tag_trie_nodes] = (TagTrieNode){ .c = c, .child = -1, .sibling = -1, .tag = -1 };
+    return tag_trie_nodes++;
+}
+
+// The child of node for c, created in character order if create is set, -1 if there is none
+int tag_trie_child(int node, char c, bool create) {
+    short *link = &tag_trie[node].child;
+    while ((*link >= 0) && (tag_trie[*link].c < c)) {
+        link = &tag_trie[*link].sibling;
+    }
+    if ((*link >= 0) && (tag_trie[*link].c == c)) {
+        return *link;
+    }
+    if (!create) {
+        return -1;
+    }
+    int child = tag_trie_node(c);
+    if (child >= 0) {
+        tag_trie[child].sibling = *link;
+        *link = child;
+    }
+    return child;
+}
+
+int tag_trie_number(int node, int next) {
+    tag_trie[node].first = next;
+    if (tag_trie[node].tag >= 0) {
+        tag_trie_order[next++] = tag_trie[node].tag;
+    }
+    for (int child = tag_trie[node].child; child >= 0; child = tag_trie[child].sibling) {
+        next = tag_trie_number(child, next);
+    }
+    tag_trie[node].end = next;
+    return next;
+}
+
+void tag_trie_init(void) {
+    int root = tag_trie_node(0);
+    for (int ti = 0; ti < TAG_COUNT; ti++) {
+        int node = root;
+        for (const char *c = tagData[ti].topic; *c && (node >= 0); c++) {
+            node = tag_trie_child(node, *c, true);
+        }
+        if (node >= 0) {
+            tag_trie[node].tag = ti; // topics are unique
+        }
+    }
+    tag_trie_number(root, 0);
+}
+
+int tag_topic_match(const char *pattern, const int **tags) {
+    pthread_once(&tag_trie_once, tag_trie_init);
+    size_t length = strlen(pattern);
+    bool prefix = (length > 0) && (pattern[length - 1] == '*');
+    int node = 0;
+    for (size_t i = 0; (i < length - prefix) && (node >= 0); i++) {
+        node = tag_trie_child(node, pattern[i], false);
+    }
+    if ((node < 0) || (!prefix && (tag_trie[node].tag < 0))) {
+        return 0;
+    }
+    *tags = &tag_trie_order[tag_trie[node].first];
+    return prefix ? tag_trie[node].end - tag_trie[node].first : 1;
+}
+
+
+#pragma mark - Frame cursor
+
+FrameCursor cursor_make(const unsigned char *data, size_t length) {
+    FrameCursor cursor = { .data = data, .remaining = data ? length : 0 };
+    return cursor;
+}
+
+// Reads a big endian unsigned value of width bytes (1 to 4)
+bool cursor_read_be(FrameCursor *cursor, int width, unsigned int *value) {
+    if ((width < 1) || (width > 4) || ((size_t)width > cursor->remaining)) {
+        return false;
+    }
+    unsigned int v = 0;
+    for (int i = 0; i < width; i++) {
+        v = (v << 8) + cursor->data[i];
+    }
+    cursor->data += width;
+    cursor->remaining -= width;
+    *value = v;
+    return true;
+}
+
+// Splits the next length bytes off into their own cursor, empty if there aren't that many left
+FrameCursor cursor_take(FrameCursor *cursor, size_t length) {
+    if (length > cursor->remaining) {
+        return cursor_make(NULL, 0);
+    }
+    FrameCursor taken = cursor_make(cursor->data, length);
+    cursor->data += length;
+    cursor->remaining -= length;
+    return taken;
+}
+
+
+#pragma mark - Decoding
+
+double tag_value_as_double(const TagValue *value) {
+    double result = value->value;
+    for (int e = value->exponent; e < 0; e++) {
+        result /= 10.0;
+    }
+    return result;
+}
+
+// Decodes the data of one tag into a typed value, false if the data is too short or the tag isn't numeric
+bool decode_tag_value(int ti, FrameCursor cursor, TagValue *value) {
+    TAG_PROCESSING_TYPE tagType = tagData[ti].type;
+    unsigned int raw;
+    unsigned int battery;
+    value->exponent = tagTypeExponent(tagType);
+    value->hasBattery = false;
+    value->battery = 0;
+    switch (tagType) {
+        case TAG_TYPE_BYTE_LEAVE_ALONE:
+        case TAG_TYPE_SHORT_LEAVE_ALONE:
+        case TAG_TYPE_3_BYTES_LEAVE_ALONE:
+        case TAG_TYPE_INT_LEAVE_ALONE:
+            if (!cursor_read_be(&cursor, tagTypeDataLength(tagType), &raw)) return false;
+            value->value = (int32_t)raw;
+            return true;
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED:
+            if (!cursor_read_be(&cursor, 2, &raw)) return false;
+            value->value = raw;
+            return true;
+        case TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED:
+            if (!cursor_read_be(&cursor, 2, &raw)) return false;
+            value->value = (int16_t)raw;
+            return true;
+        case TAG_TYPE_3_BYTES_TEMP_AND_BATT:
+            if (!cursor_read_be(&cursor, 2, &raw) || !cursor_read_be(&cursor, 1, &battery)) return false;
+            value->value = (int16_t)raw;
+            value->hasBattery = true;
+            value->battery = battery * 2; // 0.02V units
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,83 @@
+/*
+  ecowitt_tags.h
+
+  Live data tags: the table of known tags, and the rules used to decode each of them
+  into a typed value. Shared by the daemon and the batch decoder, nothing in here uses MQTT.
+*/
+
+#ifndef ECOWITT_TAGS_H
+#define ECOWITT_TAGS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ecowitt.h"
+
+#define TAG_COUNT                    116
+#define TAG_MAX_DATA_LENGTH          20
+
+typedef enum {
+    TAG_TYPE_BYTE_LEAVE_ALONE,
+    TAG_TYPE_SHORT_LEAVE_ALONE,
+    TAG_TYPE_3_BYTES_LEAVE_ALONE,
+    TAG_TYPE_INT_LEAVE_ALONE,
+    TAG_TYPE_SHORT_DIVIDE_BY_10_UNSIGNED,
+    TAG_TYPE_SHORT_DIVIDE_BY_10_SIGNED,
+    TAG_TYPE_3_BYTES_TEMP_AND_BATT,
+    TAG_TYPE_3_BYTES_TIME,
+    TAG_TYPE_6_BYTES_TIME,
+    TAG_TYPE_16_BYTES_BITMASK,
+    TAG_TYPE_16_BYTES_CO2,
+    TAG_TYPE_20_BYTES_PIEZO_GAIN,
+    TAG_TYPE_PM25_AQI,
+} TAG_PROCESSING_TYPE;
+
+typedef struct {
+    unsigned char           tag;
+    TAG_PROCESSING_TYPE     type;
+    char*                   topic;
+} TagSpec;
+
+extern TagSpec tagData[TAG_COUNT];
+
+int tagTypeDataLength(TAG_PROCESSING_TYPE tagType);
+int tagTypeExponent(TAG_PROCESSING_TYPE tagType);
+bool tagTypeIsNumeric(TAG_PROCESSING_TYPE tagType);
+int tag_count(void);
+int tag_index(int tag);
+// Tags whose topic is pattern, or starts with it when it ends in *: a run of tag indices in topic order
+int tag_topic_match(const char *pattern, const int **tags);
+
+
+/*
+ * A (pointer, remaining) view over received bytes. Every read checks the remaining length first,
+ * so decoding can never run past the bytes that were actually received.
+ */
+typedef struct {
+    const unsigned char    *data;
+    size_t                  remaining;
+} FrameCursor;
+
+FrameCursor cursor_make(const unsigned char *data, size_t length);
+bool cursor_read_be(FrameCursor *cursor, int width, unsigned int *value);
+FrameCursor cursor_take(FrameCursor *cursor, size_t length);
+
+
+/*
+ * A decoded numeric tag, as a fixed point value: value * 10^exponent. Temperature sensors that also
+ * report their battery carry it alongside, in hundredths of a volt.
+ */
+typedef struct {
+    int32_t                 value;
+    int                     exponent;
+    bool                    hasBattery;
+    int32_t                 battery;
+} TagValue;
+
+#define TAG_BATTERY_EXPONENT         -2
+
+bool decode_tag_value(int ti, FrameCursor cursor, TagValue *value);
+double tag_value_as_double(const TagValue *value);
+
+#endif